@@ -0,0 +1,124 @@
+// Cold-cache writer throughput on a directory tree, insertion order against layout order
+//
+// Usage: virtualtfa_layout_bench <directory> [chunk_size]
+// Page cache is dropped before each pass, which needs root. Without it the numbers are warm-cache.
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // nftw flags
+#endif
+
+#include "virtualtfa.h"
+
+#include <ftw.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static virtualtfa_entry** bench_entries;
+static size_t bench_entries_size;
+static size_t bench_root_size;
+
+static int bench_visit(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void) st;
+    (void) ftw;
+    if (type != FTW_F) {
+        return 0;
+    }
+    virtualtfa_entry* entry = virtualtfa_entry_new();
+    if (virtualtfa_entry_set_file(entry, path) != 0) {
+        virtualtfa_entry_free(entry);
+        return 0;
+    }
+    virtualtfa_entry_set_name(entry, strdup(path + bench_root_size + 1));
+    virtualtfa_entry** new_entries = (virtualtfa_entry**) realloc(bench_entries,
+                                                                    (bench_entries_size + 1) * sizeof(virtualtfa_entry*));
+    if (!new_entries) {
+        return 1;
+    }
+    bench_entries = new_entries;
+    bench_entries[bench_entries_size++] = entry;
+    return 0;
+}
+
+static double bench_now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void bench_drop_caches(void) {
+    sync();
+    FILE* file = fopen("/proc/sys/vm/drop_caches", "w");
+    if (!file) {
+        fprintf(stderr, "unable to drop page cache, results are warm-cache\n");
+        return;
+    }
+    fputs("3", file);
+    fclose(file);
+}
+
+static int bench_pass(const char* label, bool sort, tfa_size_t chunk_size, char* buffer) {
+    virtualtfa_archive* archive = virtualtfa_archive_new();
+    for (size_t i = 0; i < bench_entries_size; ++i) {
+        virtualtfa_archive_add(archive, bench_entries[i]);
+    }
+    double sort_start = bench_now();
+    if (sort && virtualtfa_archive_sort_by_layout(archive) != 0) {
+        return 1;
+    }
+    double sort_elapsed = bench_now() - sort_start;
+
+    virtualtfa_writer* writer = virtualtfa_writer_new();
+    virtualtfa_writer_set_archive(writer, archive);
+    tfa_size_t archive_size = virtualtfa_writer_calc_size(writer);
+
+    bench_drop_caches();
+    double start = bench_now();
+    tfa_size_t bytes_written;
+    do {
+        if (virtualtfa_writer_write(writer, buffer, chunk_size, &bytes_written) != 0) {
+            return 1;
+        }
+    } while (bytes_written > 0);
+    double elapsed = bench_now() - start;
+
+    printf("%-10s %zu files, %llu bytes: %.3f s, %.1f MB/s, %.0f files/s (sort %.3f s)\n", label,
+           bench_entries_size, (unsigned long long) archive_size, elapsed, (double) archive_size / elapsed / 1e6,
+           (double) bench_entries_size / elapsed, sort_elapsed);
+
+    virtualtfa_writer_free(writer);
+    virtualtfa_archive_free(archive);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <directory> [chunk_size]\n", argv[0]);
+        return 1;
+    }
+    const char* root = argv[1];
+    tfa_size_t chunk_size = argc > 2 ? strtoull(argv[2], NULL, 10) : 1048576;
+    bench_root_size = strlen(root);
+    while (bench_root_size > 1 && root[bench_root_size - 1] == '/') {
+        bench_root_size--;
+    }
+
+    // Directory order as returned by readdir
+    if (nftw(root, bench_visit, 64, FTW_PHYS) != 0) {
+        fprintf(stderr, "unable to walk %s\n", root);
+        return 1;
+    }
+
+    char* buffer = (char*) malloc(chunk_size);
+    int result = bench_pass("insertion", false, chunk_size, buffer) ||
+                 bench_pass("layout", true, chunk_size, buffer);
+
+    for (size_t i = 0; i < bench_entries_size; ++i) {
+        free((char*) virtualtfa_entry_get_name(bench_entries[i]));
+        virtualtfa_entry_free(bench_entries[i]);
+    }
+    free(bench_entries);
+    free(buffer);
+    return result;
+}
@@ -0,0 +1,132 @@
+// Reader throughput on an archive of many small files
+//
+// Usage: virtualtfa_reader_bench [file_count] [file_size] [chunk_size]
+// Files are extracted into ./virtualtfa_bench_out
+
+#include "virtualtfa.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(_WIN32)
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#else
+#include <sys/stat.h>
+#endif
+
+#define NAME_SIZE 24 // "f" and the largest size_t in decimal
+
+typedef struct {
+    const char* data;
+    tfa_size_t size;
+    tfa_size_t pos;
+} bench_source;
+
+static tfa_size_t bench_read(void* userdata, char* buffer, tfa_size_t buffer_size) {
+    bench_source* source = (bench_source*) userdata;
+    tfa_size_t remain = source->size - source->pos;
+    tfa_size_t to_read = remain < buffer_size ? remain : buffer_size;
+    memcpy(buffer, source->data + source->pos, to_read);
+    source->pos += to_read;
+    return to_read;
+}
+
+static void bench_close(void* userdata) {
+    free(userdata);
+}
+
+static const char* bench_data;
+static tfa_size_t bench_file_size;
+
+static virtualtfa_input_stream* bench_supplier(void* userdata) {
+    (void) userdata;
+    bench_source* source = (bench_source*) malloc(sizeof(bench_source));
+    source->data = bench_data;
+    source->size = bench_file_size;
+    source->pos = 0;
+    virtualtfa_input_stream* stream = virtualtfa_input_stream_new();
+    virtualtfa_input_stream_set_read_function(stream, bench_read);
+    virtualtfa_input_stream_set_read_userdata(stream, source);
+    virtualtfa_input_stream_set_close_function(stream, bench_close);
+    virtualtfa_input_stream_set_close_userdata(stream, source);
+    return stream;
+}
+
+static double bench_now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+    size_t file_count = argc > 1 ? (size_t) strtoull(argv[1], NULL, 10) : 10000;
+    bench_file_size = argc > 2 ? strtoull(argv[2], NULL, 10) : 1024;
+    tfa_size_t chunk_size = argc > 3 ? strtoull(argv[3], NULL, 10) : 65536;
+
+    char* data = (char*) malloc(bench_file_size ? bench_file_size : 1);
+    for (tfa_size_t i = 0; i < bench_file_size; ++i) {
+        data[i] = (char) (i * 31);
+    }
+    bench_data = data;
+
+    // Build the archive in memory
+    virtualtfa_archive* archive = virtualtfa_archive_new();
+    virtualtfa_entry** entries = (virtualtfa_entry**) malloc(file_count * sizeof(virtualtfa_entry*));
+    char* names = (char*) malloc(file_count * NAME_SIZE);
+    for (size_t i = 0; i < file_count; ++i) {
+        snprintf(names + i * NAME_SIZE, NAME_SIZE, "f%zu", i);
+        entries[i] = virtualtfa_entry_new();
+        virtualtfa_entry_set_name(entries[i], names + i * NAME_SIZE);
+        virtualtfa_entry_set_size(entries[i], bench_file_size);
+        virtualtfa_entry_set_input_stream_supplier(entries[i], bench_supplier);
+        virtualtfa_archive_add(archive, entries[i]);
+    }
+    virtualtfa_writer* writer = virtualtfa_writer_new();
+    virtualtfa_writer_set_archive(writer, archive);
+    tfa_size_t archive_size = virtualtfa_writer_calc_size(writer);
+    char* archive_data = (char*) malloc(archive_size);
+    tfa_size_t written = 0;
+    tfa_size_t bytes_written;
+    do {
+        if (virtualtfa_writer_write(writer, archive_data + written, chunk_size, &bytes_written) != 0) {
+            return 1;
+        }
+        written += bytes_written;
+    } while (bytes_written > 0);
+
+    char dest[] = "virtualtfa_bench_out";
+    mkdir(dest, 0755);
+
+    virtualtfa_reader* reader = virtualtfa_reader_new();
+    virtualtfa_reader_set_dest(reader, dest);
+    double start = bench_now();
+    tfa_size_t read = 0;
+    while (read < archive_size) {
+        tfa_size_t to_read = archive_size - read < chunk_size ? archive_size - read : chunk_size;
+        tfa_size_t bytes_read;
+        if (virtualtfa_reader_read(reader, archive_data + read, to_read, &bytes_read) != 0 || bytes_read != to_read) {
+            fprintf(stderr, "read failed at %llu\n", (unsigned long long) read);
+            return 1;
+        }
+        read += bytes_read;
+    }
+    double elapsed = bench_now() - start;
+
+    printf("%zu files of %llu bytes, %llu byte chunks: %.3f s, %.1f MB/s, %.0f files/s\n",
+           file_count, (unsigned long long) bench_file_size, (unsigned long long) chunk_size, elapsed,
+           (double) archive_size / elapsed / 1e6, (double) file_count / elapsed);
+
+    virtualtfa_reader_free(reader);
+    virtualtfa_writer_free(writer);
+    virtualtfa_archive_free(archive);
+    for (size_t i = 0; i < file_count; ++i) {
+        virtualtfa_entry_free(entries[i]);
+    }
+    free(entries);
+    free(names);
+    free(archive_data);
+    free(data);
+    return 0;
+}
@@ -9,15 +9,30 @@ extern "C" {
 #include <stdio.h>
 #include <stdbool.h>
 
+#if !defined(_WIN32)
+#include <sys/uio.h>
+#endif
+
 typedef uint64_t tfa_size_t;
 typedef uint64_t tfa_utime_t;
 typedef int32_t tfa_mode_t;
+typedef uint8_t tfa_typeflag_t;
+
+#define VIRTUALTFA_TYPEFLAG_FILE     0
+#define VIRTUALTFA_TYPEFLAG_DELETED  1 // no data, the reader removes the file
+#define VIRTUALTFA_TYPEFLAG_CHUNKED  2 // unknown size, the input stream is read until EOF
+#define VIRTUALTFA_TYPEFLAG_SPARSE   3 // extent map followed by the data extents only
+
+#define VIRTUALTFA_SIZE_UNKNOWN  ((tfa_size_t) -1)
 
 typedef struct _virtualtfa_archive virtualtfa_archive;
 typedef struct _virtualtfa_entry virtualtfa_entry;
+typedef struct _virtualtfa_manifest virtualtfa_manifest;
 
 typedef tfa_size_t (*virtualtfa_read_function)(void* userdata, char* buffer, tfa_size_t buffer_size);
 typedef void (*virtualtfa_close_function)(void* userdata);
+typedef int (*virtualtfa_seek_function)(void* userdata, tfa_size_t offset);
+typedef int (*virtualtfa_hash_function)(void* userdata, const char* path, uint64_t* out_hash);
 
 typedef struct _virtualtfa_input_stream virtualtfa_input_stream;
 
@@ -31,6 +46,8 @@ typedef struct {
     tfa_mode_t    mode;
 } virtualtfa_file_info;
 
+typedef void (*virtualtfa_file_skipped_function)(void* userdata, const virtualtfa_file_info*);
+
 typedef struct {
     void (*total_progress)(void* userdata, tfa_size_t);
     void *total_progress_userdata;
@@ -44,6 +61,7 @@ typedef struct {
 
 typedef struct _virtualtfa_writer virtualtfa_writer;
 typedef struct _virtualtfa_reader virtualtfa_reader;
+typedef struct _virtualtfa_scheduler virtualtfa_scheduler;
 
 /*
  * Methods
@@ -60,7 +78,12 @@ virtualtfa_close_function  virtualtfa_input_stream_get_close_function(virtualtfa
 void                       virtualtfa_input_stream_set_close_function(virtualtfa_input_stream*, virtualtfa_close_function);
 void*                      virtualtfa_input_stream_get_close_userdata(virtualtfa_input_stream*);
 void                       virtualtfa_input_stream_set_close_userdata(virtualtfa_input_stream*, void*);
+virtualtfa_seek_function   virtualtfa_input_stream_get_seek_function(virtualtfa_input_stream*);
+void                       virtualtfa_input_stream_set_seek_function(virtualtfa_input_stream*, virtualtfa_seek_function);
+void*                      virtualtfa_input_stream_get_seek_userdata(virtualtfa_input_stream*);
+void                       virtualtfa_input_stream_set_seek_userdata(virtualtfa_input_stream*, void*);
 int                        virtualtfa_input_stream_read(virtualtfa_input_stream*, char* buffer, tfa_size_t buffer_size, tfa_size_t* out_bytes_read);
+int                        virtualtfa_input_stream_seek(virtualtfa_input_stream*, tfa_size_t offset);
 void                       virtualtfa_input_stream_close(virtualtfa_input_stream*);
 
 virtualtfa_entry* virtualtfa_entry_new(void);
@@ -80,12 +103,38 @@ tfa_utime_t                       virtualtfa_entry_get_mtime(virtualtfa_entry*);
 void                              virtualtfa_entry_set_mtime(virtualtfa_entry*, tfa_utime_t);
 tfa_mode_t                        virtualtfa_entry_get_mode(virtualtfa_entry*);
 void                              virtualtfa_entry_set_mode(virtualtfa_entry*, tfa_mode_t);
+tfa_typeflag_t                    virtualtfa_entry_get_typeflag(virtualtfa_entry*);
+void                              virtualtfa_entry_set_typeflag(virtualtfa_entry*, tfa_typeflag_t);
+uint64_t                          virtualtfa_entry_get_hash(virtualtfa_entry*);
+void                              virtualtfa_entry_set_hash(virtualtfa_entry*, uint64_t); // 0 means none
+
+// Fill size, times and mode from the file at path and stream it with the built-in file supplier.
+// Files with holes become sparse entries.
+int                               virtualtfa_entry_set_file(virtualtfa_entry*, const char* path);
 
 virtualtfa_archive*  virtualtfa_archive_new(void);
 void			           virtualtfa_archive_free(virtualtfa_archive*);
 
 void virtualtfa_archive_add(virtualtfa_archive*, virtualtfa_entry*);
 
+// Serialize all headers and names once and make the archive immutable. Neither the archive nor its
+// entries may be modified afterwards, in exchange any number of writers on any threads can share it.
+int                  virtualtfa_archive_freeze(virtualtfa_archive*);
+bool                 virtualtfa_archive_is_frozen(virtualtfa_archive*);
+// Reorder entries added with virtualtfa_entry_set_file by the on-disk position of their first extent,
+// falling back to inode number and then insertion order, so that writing reads the source disk mostly
+// sequentially. Call before virtualtfa_archive_freeze.
+int                  virtualtfa_archive_sort_by_layout(virtualtfa_archive*);
+
+// Record name, size, mtime and hash of every entry, to be used as the previous manifest of the next transfer
+int                  virtualtfa_archive_write_manifest(virtualtfa_archive*, const char* path);
+// New archive with the new or changed entries and deletion records for names missing from the archive.
+// Deletion records reference names inside the manifest, which must outlive the returned archive.
+virtualtfa_archive*  virtualtfa_archive_new_delta(virtualtfa_archive*, virtualtfa_manifest* previous);
+
+virtualtfa_manifest*  virtualtfa_manifest_open(const char* path); // memory mapped
+void                  virtualtfa_manifest_free(virtualtfa_manifest*);
+
 virtualtfa_writer*  virtualtfa_writer_new(void);
 void                virtualtfa_writer_free(virtualtfa_writer*);
 
@@ -93,9 +142,26 @@ virtualtfa_archive*   virtualtfa_writer_get_archive(virtualtfa_writer*);
 void                  virtualtfa_writer_set_archive(virtualtfa_writer*, virtualtfa_archive*);
 virtualtfa_listener*  virtualtfa_writer_get_listener(virtualtfa_writer*);
 void                  virtualtfa_writer_set_listener(virtualtfa_writer*, virtualtfa_listener*);
-tfa_size_t            virtualtfa_writer_calc_size(virtualtfa_writer*);
+tfa_size_t            virtualtfa_writer_get_position(virtualtfa_writer*);
+tfa_size_t            virtualtfa_writer_calc_size(virtualtfa_writer*); // VIRTUALTFA_SIZE_UNKNOWN with chunked entries
 int                   virtualtfa_writer_write(virtualtfa_writer*, char* buffer, tfa_size_t buffer_size, tfa_size_t* out_bytes_written);
 
+// Restrict the writer to archive bytes [start, end), call before the first write. The archive is
+// only read while writing, so several writers on different threads may share one archive and
+// produce disjoint ranges of it in parallel. Not supported for archives with chunked entries.
+void                  virtualtfa_writer_set_range(virtualtfa_writer*, tfa_size_t start, tfa_size_t end);
+
+#if !defined(_WIN32)
+// Describe up to max iovecs and max_bytes of archive data from the current position without copying
+// headers and names, for writev or sendmsg. File data is prefetched into a writer-owned buffer. The
+// iovecs stay valid until the next call, which returns the same bytes unless the writer was advanced.
+// The archive must be frozen and without chunked entries. Do not mix with virtualtfa_writer_write.
+int                   virtualtfa_writer_next_iovecs(virtualtfa_writer*, struct iovec* out, int max, size_t max_bytes, int* out_count);
+// Move the position past bytes actually sent, which may end in the middle of a returned batch. File
+// progress and file_end are reported here for the file data sent, not when it is prefetched.
+int                   virtualtfa_writer_advance(virtualtfa_writer*, tfa_size_t bytes);
+#endif
+
 virtualtfa_reader*  virtualtfa_reader_new(void);
 void                virtualtfa_reader_free(virtualtfa_reader*);
 
@@ -103,8 +169,69 @@ const char*           virtualtfa_reader_get_dest(virtualtfa_reader*);
 void                  virtualtfa_reader_set_dest(virtualtfa_reader*, const char* dest);
 virtualtfa_listener*  virtualtfa_reader_get_listener(virtualtfa_reader*);
 void                  virtualtfa_reader_set_listener(virtualtfa_reader*, virtualtfa_listener*);
+tfa_size_t            virtualtfa_reader_get_total_read(virtualtfa_reader*);
+
+// Leave plain files whose destination already has the header size and mtime untouched, their data
+// is consumed without opening the file and the skipped function is called instead of file_end.
+// With a hash function, entries carrying a hash must also match the hash of the destination file.
+bool                      virtualtfa_reader_get_skip_unchanged(virtualtfa_reader*);
+void                      virtualtfa_reader_set_skip_unchanged(virtualtfa_reader*, bool);
+virtualtfa_file_skipped_function  virtualtfa_reader_get_skipped_function(virtualtfa_reader*);
+void                              virtualtfa_reader_set_skipped_function(virtualtfa_reader*, virtualtfa_file_skipped_function);
+void*                             virtualtfa_reader_get_skipped_userdata(virtualtfa_reader*);
+void                              virtualtfa_reader_set_skipped_userdata(virtualtfa_reader*, void*);
+virtualtfa_hash_function  virtualtfa_reader_get_hash_function(virtualtfa_reader*);
+void                      virtualtfa_reader_set_hash_function(virtualtfa_reader*, virtualtfa_hash_function);
+void*                     virtualtfa_reader_get_hash_userdata(virtualtfa_reader*);
+void                      virtualtfa_reader_set_hash_userdata(virtualtfa_reader*, void*);
+
+// out_bytes_read is set on every call. A corrupt stream or a file that cannot be written fails the
+// reader and later calls return 1 until virtualtfa_reader_restore.
 int                   virtualtfa_reader_read(virtualtfa_reader *, char* buffer, tfa_size_t buffer_size, tfa_size_t* out_bytes_read);
 
+#if defined(__linux__)
+// Consume up to max_bytes from in_fd, stopping early at end of input or when a non-blocking in_fd
+// would block. Headers and names are read into a small buffer, plain file data is spliced through a
+// pipe straight into the destination file and never copied into userspace.
+int                   virtualtfa_reader_read_from_fd(virtualtfa_reader*, int in_fd, tfa_size_t max_bytes, tfa_size_t* out_bytes_read);
+#endif
+
+// Serialize the parse state, the sender resumes from virtualtfa_reader_get_total_read. Passing a
+// too small buffer returns 1 with the required size in out_checkpoint_size.
+int                   virtualtfa_reader_checkpoint(virtualtfa_reader*, char* buffer, tfa_size_t buffer_size, tfa_size_t* out_checkpoint_size);
+// Restore a checkpoint into a reader with the same dest, reopening a partially written file
+int                   virtualtfa_reader_restore(virtualtfa_reader*, const char* buffer, tfa_size_t buffer_size);
+
+// Seekable file keeping ranges received ahead of the parsed position, required by read_at
+FILE*                 virtualtfa_reader_get_spool(virtualtfa_reader*);
+void                  virtualtfa_reader_set_spool(virtualtfa_reader*, FILE* spool);
+// Accept archive bytes starting at offset in any order, calls must not run concurrently
+int                   virtualtfa_reader_read_at(virtualtfa_reader*, tfa_size_t offset, char* buffer, tfa_size_t buffer_size, tfa_size_t* out_bytes_read);
+
+// Shares bandwidth between writers running on different threads. Each virtualtfa_scheduler_write
+// call gets a budget of at most one quantum once it is the writer's turn under weighted fair
+// queuing and the global and per-writer rates allow it. A writer keeps its place while it calls
+// again within a few milliseconds of its last write.
+// The scheduler neither prefetches nor owns an IO thread pool, input is read and written on the
+// calling threads during their grants. The only bound on work in flight is max_concurrency: at most
+// that many writes run at the same time, each limited to one quantum of the caller's buffer.
+virtualtfa_scheduler*  virtualtfa_scheduler_new(void);
+void                   virtualtfa_scheduler_free(virtualtfa_scheduler*);
+
+tfa_size_t  virtualtfa_scheduler_get_rate(virtualtfa_scheduler*);
+void        virtualtfa_scheduler_set_rate(virtualtfa_scheduler*, tfa_size_t bytes_per_second); // 0 means unlimited
+int         virtualtfa_scheduler_get_max_concurrency(virtualtfa_scheduler*);
+void        virtualtfa_scheduler_set_max_concurrency(virtualtfa_scheduler*, int); // 0 means unlimited
+tfa_size_t  virtualtfa_scheduler_get_quantum(virtualtfa_scheduler*);
+void        virtualtfa_scheduler_set_quantum(virtualtfa_scheduler*, tfa_size_t); // largest budget per write, 64 KiB by default
+
+// A writer with twice the weight gets twice the bandwidth, rate caps it in bytes per second (0 means unlimited).
+// Unregister only while no virtualtfa_scheduler_write call for the writer is running.
+int         virtualtfa_scheduler_register(virtualtfa_scheduler*, virtualtfa_writer*, uint32_t weight, tfa_size_t rate);
+void        virtualtfa_scheduler_unregister(virtualtfa_scheduler*, virtualtfa_writer*);
+// virtualtfa_writer_write limited to the granted budget, blocks until the writer's turn
+int         virtualtfa_scheduler_write(virtualtfa_scheduler*, virtualtfa_writer*, char* buffer, tfa_size_t buffer_size, tfa_size_t* out_bytes_written);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
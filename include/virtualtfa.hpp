@@ -0,0 +1,598 @@
+#ifndef VIRTUALTFA_HPP
+#define VIRTUALTFA_HPP
+
+// Header-only C++20 layer over virtualtfa.h
+//
+// Sources, sinks and listeners are template parameters. The C core still gets plain function pointers
+// with void* userdata: each one is a trampoline instantiated for the concrete type, which casts the
+// userdata back to that type and calls it directly, without virtual dispatch. A trampoline catches
+// any exception, keeps the first one in a thread_local exception_ptr, returns a failure value to the
+// core and the exception is rethrown once the C call returns.
+//
+// The core is synchronous. The async_ members return awaitables that hand the coroutine to an executor
+// and run the blocking call on whatever thread the executor resumes it on.
+
+#include "virtualtfa.h"
+
+#include <concepts>
+#include <coroutine>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace virtualtfa {
+
+class error : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+namespace detail {
+
+template <auto Free>
+struct deleter {
+    template <class T>
+    void operator()(T* ptr) const noexcept {
+        Free(ptr);
+    }
+};
+
+template <class T, auto Free>
+using handle = std::unique_ptr<T, deleter<Free>>;
+
+// First exception thrown by a callback during the current C call on this thread
+inline std::exception_ptr& pending_exception() {
+    thread_local std::exception_ptr pending;
+    return pending;
+}
+
+template <class F, class R>
+R guard(F&& f, R on_exception) noexcept {
+    try {
+        return f();
+    } catch (...) {
+        if (!pending_exception()) {
+            pending_exception() = std::current_exception();
+        }
+        return on_exception;
+    }
+}
+
+inline void rethrow_pending() {
+    if (std::exception_ptr pending = std::exchange(pending_exception(), nullptr)) {
+        std::rethrow_exception(pending);
+    }
+}
+
+inline void check(int result, const char* what) {
+    rethrow_pending();
+    if (result != 0) {
+        throw error(what);
+    }
+}
+
+// Resumes the coroutine through the executor, the operation runs when it is resumed
+template <class Executor, class Operation>
+class offload_awaitable {
+public:
+    offload_awaitable(Executor& executor, Operation operation)
+            : executor_(executor), operation_(std::move(operation)) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) { executor_(handle); }
+    decltype(auto) await_resume() { return operation_(); }
+
+private:
+    Executor& executor_;
+    Operation operation_;
+};
+
+} // namespace detail
+
+/*
+ * Concepts
+ */
+
+// std::size_t read(std::span<char>), returns 0 at EOF. Optional bool seek(tfa_size_t) and void close().
+template <class S>
+concept source = requires(S& s, std::span<char> buffer) {
+    { s.read(buffer) } -> std::convertible_to<std::size_t>;
+};
+
+// Callable creating a source every time the writer reaches the entry data
+template <class F>
+concept source_supplier = std::invocable<F&> && source<std::invoke_result_t<F&>>;
+
+// Callable consuming the bytes produced by a writer
+template <class S>
+concept sink = std::invocable<S&, std::span<const char>>;
+
+// Callable taking a suspended coroutine and resuming it later, typically on a worker thread
+template <class E>
+concept executor = std::invocable<E&, std::coroutine_handle<>>;
+
+// Any subset of total_progress(tfa_size_t), file_start(const virtualtfa_file_info&),
+// file_progress(const virtualtfa_file_info&, tfa_size_t), file_end(const virtualtfa_file_info&) and, for
+// readers, file_skipped(const virtualtfa_file_info&)
+struct no_listener {};
+
+namespace detail {
+
+template <source Source>
+tfa_size_t source_read(void* userdata, char* buffer, tfa_size_t buffer_size) {
+    return guard([&] {
+        return static_cast<tfa_size_t>(static_cast<Source*>(userdata)->read(
+                std::span<char>(buffer, static_cast<std::size_t>(buffer_size))));
+    }, tfa_size_t(0));
+}
+
+template <source Source>
+int source_seek(void* userdata, tfa_size_t offset) {
+    return guard([&] { return static_cast<Source*>(userdata)->seek(offset) ? 0 : 1; }, 1);
+}
+
+template <source Source>
+void source_close(void* userdata) {
+    auto* src = static_cast<Source*>(userdata);
+    if constexpr (requires { src->close(); }) {
+        guard([&] {
+            src->close();
+            return 0;
+        }, 0);
+    }
+    delete src;
+}
+
+template <source_supplier Supplier>
+virtualtfa_input_stream* supply(void* userdata) {
+    using Source = std::invoke_result_t<Supplier&>;
+    virtualtfa_input_stream* stream = virtualtfa_input_stream_new();
+    if (!stream) {
+        return nullptr;
+    }
+    auto* src = guard([&] { return new Source((*static_cast<Supplier*>(userdata))()); }, static_cast<Source*>(nullptr));
+    if (!src) {
+        virtualtfa_input_stream_free(stream);
+        return nullptr;
+    }
+    virtualtfa_input_stream_set_read_function(stream, &source_read<Source>);
+    virtualtfa_input_stream_set_read_userdata(stream, src);
+    virtualtfa_input_stream_set_close_function(stream, &source_close<Source>);
+    virtualtfa_input_stream_set_close_userdata(stream, src);
+    if constexpr (requires(Source& s, tfa_size_t offset) { { s.seek(offset) } -> std::convertible_to<bool>; }) {
+        virtualtfa_input_stream_set_seek_function(stream, &source_seek<Source>);
+        virtualtfa_input_stream_set_seek_userdata(stream, src);
+    }
+    return stream;
+}
+
+template <class Listener>
+void listener_total_progress(void* userdata, tfa_size_t total) {
+    if constexpr (requires(Listener& l) { l.total_progress(total); }) {
+        guard([&] {
+            static_cast<Listener*>(userdata)->total_progress(total);
+            return 0;
+        }, 0);
+    }
+}
+
+template <class Listener>
+void listener_file_start(void* userdata, const virtualtfa_file_info* info) {
+    if constexpr (requires(Listener& l) { l.file_start(*info); }) {
+        guard([&] {
+            static_cast<Listener*>(userdata)->file_start(*info);
+            return 0;
+        }, 0);
+    }
+}
+
+template <class Listener>
+void listener_file_progress(void* userdata, const virtualtfa_file_info* info, tfa_size_t progress) {
+    if constexpr (requires(Listener& l) { l.file_progress(*info, progress); }) {
+        guard([&] {
+            static_cast<Listener*>(userdata)->file_progress(*info, progress);
+            return 0;
+        }, 0);
+    }
+}
+
+template <class Listener>
+void listener_file_end(void* userdata, const virtualtfa_file_info* info) {
+    if constexpr (requires(Listener& l) { l.file_end(*info); }) {
+        guard([&] {
+            static_cast<Listener*>(userdata)->file_end(*info);
+            return 0;
+        }, 0);
+    }
+}
+
+template <class Listener>
+void listener_file_skipped(void* userdata, const virtualtfa_file_info* info) {
+    if constexpr (requires(Listener& l) { l.file_skipped(*info); }) {
+        guard([&] {
+            static_cast<Listener*>(userdata)->file_skipped(*info);
+            return 0;
+        }, 0);
+    }
+}
+
+template <class Hasher>
+int hash_file(void* userdata, const char* path, uint64_t* out_hash) {
+    return guard([&] {
+        *out_hash = static_cast<uint64_t>((*static_cast<Hasher*>(userdata))(path));
+        return 0;
+    }, 1);
+}
+
+// C listener pointing at a Listener, nothing at all for no_listener. Both live on the heap, the C
+// handle keeps their addresses when the owning writer or reader is moved.
+template <class Listener>
+class listener_binding {
+public:
+    explicit listener_binding(Listener listener)
+            : listener_(std::make_unique<Listener>(std::move(listener))),
+              c_listener_(std::make_unique<virtualtfa_listener>()) {
+        c_listener_->total_progress = &listener_total_progress<Listener>;
+        c_listener_->total_progress_userdata = listener_.get();
+        c_listener_->file_start = &listener_file_start<Listener>;
+        c_listener_->file_start_userdata = listener_.get();
+        c_listener_->file_progress = &listener_file_progress<Listener>;
+        c_listener_->file_progress_userdata = listener_.get();
+        c_listener_->file_end = &listener_file_end<Listener>;
+        c_listener_->file_end_userdata = listener_.get();
+    }
+
+    Listener& get() { return *listener_; }
+
+    virtualtfa_listener* c_listener() { return c_listener_.get(); }
+
+private:
+    std::unique_ptr<Listener> listener_;
+    std::unique_ptr<virtualtfa_listener> c_listener_;
+};
+
+template <>
+class listener_binding<no_listener> {
+public:
+    explicit listener_binding(no_listener) {}
+
+    no_listener get() { return {}; }
+
+    virtualtfa_listener* c_listener() { return nullptr; }
+};
+
+} // namespace detail
+
+/*
+ * Entry
+ */
+
+class entry {
+public:
+    entry() : handle_(virtualtfa_entry_new()) {
+        if (!handle_) {
+            throw error("virtualtfa_entry_new failed");
+        }
+    }
+
+    template <source_supplier Supplier>
+    entry(std::string_view name, tfa_size_t size, Supplier supplier) : entry() {
+        set_name(name);
+        set_size(size);
+        set_source(std::move(supplier));
+    }
+
+    void set_name(std::string_view name) {
+        name_ = std::make_unique<char[]>(name.size() + 1);
+        std::memcpy(name_.get(), name.data(), name.size());
+        name_[name.size()] = '\0';
+        virtualtfa_entry_set_name(handle_.get(), name_.get());
+    }
+
+    std::string_view name() const { return name_ ? std::string_view(name_.get()) : std::string_view(); }
+
+    void set_size(tfa_size_t size) { virtualtfa_entry_set_size(handle_.get(), size); }
+    tfa_size_t size() const { return virtualtfa_entry_get_size(handle_.get()); }
+    void set_ctime(tfa_utime_t ctime) { virtualtfa_entry_set_ctime(handle_.get(), ctime); }
+    tfa_utime_t ctime() const { return virtualtfa_entry_get_ctime(handle_.get()); }
+    void set_mtime(tfa_utime_t mtime) { virtualtfa_entry_set_mtime(handle_.get(), mtime); }
+    tfa_utime_t mtime() const { return virtualtfa_entry_get_mtime(handle_.get()); }
+    void set_mode(tfa_mode_t mode) { virtualtfa_entry_set_mode(handle_.get(), mode); }
+    tfa_mode_t mode() const { return virtualtfa_entry_get_mode(handle_.get()); }
+    void set_typeflag(tfa_typeflag_t typeflag) { virtualtfa_entry_set_typeflag(handle_.get(), typeflag); }
+    tfa_typeflag_t typeflag() const { return virtualtfa_entry_get_typeflag(handle_.get()); }
+    void set_hash(uint64_t hash) { virtualtfa_entry_set_hash(handle_.get(), hash); }
+    uint64_t hash() const { return virtualtfa_entry_get_hash(handle_.get()); }
+
+    // Stream the file at path with the built-in supplier, sparse files become sparse entries
+    void set_file(const char* path) {
+        detail::check(virtualtfa_entry_set_file(handle_.get(), path), "virtualtfa_entry_set_file failed");
+        supplier_.reset();
+    }
+
+    template <source_supplier Supplier>
+    void set_source(Supplier supplier) {
+        auto* stored = new Supplier(std::move(supplier));
+        supplier_ = std::shared_ptr<void>(stored, [](void* ptr) { delete static_cast<Supplier*>(ptr); });
+        virtualtfa_entry_set_input_stream_supplier(handle_.get(), &detail::supply<Supplier>);
+        virtualtfa_entry_set_input_stream_supplier_userdata(handle_.get(), stored);
+    }
+
+    virtualtfa_entry* c_entry() const { return handle_.get(); }
+
+private:
+    detail::handle<virtualtfa_entry, virtualtfa_entry_free> handle_;
+    std::unique_ptr<char[]> name_;
+    std::shared_ptr<void> supplier_;
+};
+
+/*
+ * Archive
+ */
+
+class manifest {
+public:
+    explicit manifest(const char* path) : handle_(virtualtfa_manifest_open(path)) {
+        if (!handle_) {
+            throw error("virtualtfa_manifest_open failed");
+        }
+    }
+
+    virtualtfa_manifest* c_manifest() const { return handle_.get(); }
+
+private:
+    detail::handle<virtualtfa_manifest, virtualtfa_manifest_free> handle_;
+};
+
+// Entries are referenced, not owned, and must outlive the archive
+class archive {
+public:
+    archive() : handle_(virtualtfa_archive_new()) {
+        if (!handle_) {
+            throw error("virtualtfa_archive_new failed");
+        }
+    }
+
+    void add(const entry& e) { virtualtfa_archive_add(handle_.get(), e.c_entry()); }
+
+    void sort_by_layout() {
+        detail::check(virtualtfa_archive_sort_by_layout(handle_.get()), "virtualtfa_archive_sort_by_layout failed");
+    }
+    void freeze() { detail::check(virtualtfa_archive_freeze(handle_.get()), "virtualtfa_archive_freeze failed"); }
+    bool frozen() const { return virtualtfa_archive_is_frozen(handle_.get()); }
+
+    void write_manifest(const char* path) const {
+        detail::check(virtualtfa_archive_write_manifest(handle_.get(), path),
+                      "virtualtfa_archive_write_manifest failed");
+    }
+
+    // The manifest must outlive the returned archive
+    archive delta(const manifest& previous) const {
+        virtualtfa_archive* delta = virtualtfa_archive_new_delta(handle_.get(), previous.c_manifest());
+        if (!delta) {
+            throw error("virtualtfa_archive_new_delta failed");
+        }
+        return archive(delta);
+    }
+
+    virtualtfa_archive* c_archive() const { return handle_.get(); }
+
+private:
+    explicit archive(virtualtfa_archive* handle) : handle_(handle) {}
+
+    detail::handle<virtualtfa_archive, virtualtfa_archive_free> handle_;
+};
+
+/*
+ * Writer
+ */
+
+template <class Listener = no_listener>
+class writer {
+public:
+    explicit writer(const archive& a, Listener listener = Listener())
+            : handle_(virtualtfa_writer_new()), listener_(std::move(listener)) {
+        if (!handle_) {
+            throw error("virtualtfa_writer_new failed");
+        }
+        virtualtfa_writer_set_archive(handle_.get(), a.c_archive());
+        virtualtfa_writer_set_listener(handle_.get(), listener_.c_listener());
+    }
+
+    decltype(auto) listener() { return listener_.get(); }
+
+    tfa_size_t calc_size() { return virtualtfa_writer_calc_size(handle_.get()); }
+    tfa_size_t position() { return virtualtfa_writer_get_position(handle_.get()); }
+    void set_range(tfa_size_t start, tfa_size_t end) { virtualtfa_writer_set_range(handle_.get(), start, end); }
+
+    // Returns the number of bytes written, 0 at the end of the archive or range
+    std::size_t write(std::span<char> buffer) {
+        tfa_size_t bytes_written = 0;
+        detail::check(virtualtfa_writer_write(handle_.get(), buffer.data(), buffer.size(), &bytes_written),
+                      "virtualtfa_writer_write failed");
+        return static_cast<std::size_t>(bytes_written);
+    }
+
+    // Awaitable returning what write returns, the buffer must stay valid until it completes
+    template <executor Executor>
+    auto async_write(std::span<char> buffer, Executor& executor) {
+        return detail::offload_awaitable(executor, [this, buffer] { return write(buffer); });
+    }
+
+    // Write everything through buffer into sink, returns the total number of bytes
+    template <sink Sink>
+    tfa_size_t write_to(Sink&& sink, std::span<char> buffer) {
+        tfa_size_t total = 0;
+        while (std::size_t bytes_written = write(buffer)) {
+            sink(std::span<const char>(buffer.data(), bytes_written));
+            total += bytes_written;
+        }
+        return total;
+    }
+
+#if !defined(_WIN32)
+    // Returns the number of iovecs filled, 0 at the end of the archive or range
+    std::size_t next_iovecs(std::span<struct iovec> out, std::size_t max_bytes) {
+        int count = 0;
+        detail::check(virtualtfa_writer_next_iovecs(handle_.get(), out.data(), static_cast<int>(out.size()), max_bytes,
+                                                    &count),
+                      "virtualtfa_writer_next_iovecs failed");
+        return static_cast<std::size_t>(count);
+    }
+
+    void advance(tfa_size_t bytes) {
+        detail::check(virtualtfa_writer_advance(handle_.get(), bytes), "virtualtfa_writer_advance failed");
+    }
+#endif
+
+    virtualtfa_writer* c_writer() const { return handle_.get(); }
+
+private:
+    detail::handle<virtualtfa_writer, virtualtfa_writer_free> handle_;
+    detail::listener_binding<Listener> listener_;
+};
+
+/*
+ * Scheduler
+ */
+
+// Writers must stay registered for as long as they write through the scheduler
+class scheduler {
+public:
+    scheduler() : handle_(virtualtfa_scheduler_new()) {
+        if (!handle_) {
+            throw error("virtualtfa_scheduler_new failed");
+        }
+    }
+
+    void set_rate(tfa_size_t bytes_per_second) { virtualtfa_scheduler_set_rate(handle_.get(), bytes_per_second); }
+    void set_max_concurrency(int max_concurrency) {
+        virtualtfa_scheduler_set_max_concurrency(handle_.get(), max_concurrency);
+    }
+    void set_quantum(tfa_size_t quantum) { virtualtfa_scheduler_set_quantum(handle_.get(), quantum); }
+
+    template <class Listener>
+    void add(const writer<Listener>& w, uint32_t weight = 1, tfa_size_t rate = 0) {
+        detail::check(virtualtfa_scheduler_register(handle_.get(), w.c_writer(), weight, rate),
+                      "virtualtfa_scheduler_register failed");
+    }
+
+    template <class Listener>
+    void remove(const writer<Listener>& w) { virtualtfa_scheduler_unregister(handle_.get(), w.c_writer()); }
+
+    // Blocks until the writer's turn, returns the number of bytes written, 0 at the end of the archive or range
+    template <class Listener>
+    std::size_t write(writer<Listener>& w, std::span<char> buffer) {
+        tfa_size_t bytes_written = 0;
+        detail::check(virtualtfa_scheduler_write(handle_.get(), w.c_writer(), buffer.data(), buffer.size(),
+                                                 &bytes_written),
+                      "virtualtfa_scheduler_write failed");
+        return static_cast<std::size_t>(bytes_written);
+    }
+
+    template <class Listener, executor Executor>
+    auto async_write(writer<Listener>& w, std::span<char> buffer, Executor& executor) {
+        return detail::offload_awaitable(executor, [this, &w, buffer] { return write(w, buffer); });
+    }
+
+    virtualtfa_scheduler* c_scheduler() const { return handle_.get(); }
+
+private:
+    detail::handle<virtualtfa_scheduler, virtualtfa_scheduler_free> handle_;
+};
+
+/*
+ * Reader
+ */
+
+template <class Listener = no_listener>
+class reader {
+public:
+    explicit reader(const char* dest, Listener listener = Listener())
+            : handle_(virtualtfa_reader_new()), listener_(std::move(listener)) {
+        if (!handle_) {
+            throw error("virtualtfa_reader_new failed");
+        }
+        virtualtfa_reader_set_dest(handle_.get(), dest);
+        virtualtfa_reader_set_listener(handle_.get(), listener_.c_listener());
+        if constexpr (requires(Listener& l, const virtualtfa_file_info& info) { l.file_skipped(info); }) {
+            virtualtfa_reader_set_skipped_function(handle_.get(), &detail::listener_file_skipped<Listener>);
+            virtualtfa_reader_set_skipped_userdata(handle_.get(), &listener_.get());
+        }
+    }
+
+    decltype(auto) listener() { return listener_.get(); }
+
+    tfa_size_t total_read() { return virtualtfa_reader_get_total_read(handle_.get()); }
+    void set_spool(FILE* spool) { virtualtfa_reader_set_spool(handle_.get(), spool); }
+
+    // The reader does not modify the buffer
+    std::size_t read(std::span<const char> buffer) {
+        tfa_size_t bytes_read = 0;
+        detail::check(virtualtfa_reader_read(handle_.get(), const_cast<char*>(buffer.data()), buffer.size(),
+                                             &bytes_read),
+                      "virtualtfa_reader_read failed");
+        return static_cast<std::size_t>(bytes_read);
+    }
+
+    template <executor Executor>
+    auto async_read(std::span<const char> buffer, Executor& executor) {
+        return detail::offload_awaitable(executor, [this, buffer] { return read(buffer); });
+    }
+
+    void set_skip_unchanged(bool skip) { virtualtfa_reader_set_skip_unchanged(handle_.get(), skip); }
+
+    // Callable returning the uint64_t hash of the file at a path, referenced and not copied
+    template <std::invocable<const char*> Hasher>
+    void set_hash_function(Hasher& hasher) {
+        virtualtfa_reader_set_hash_function(handle_.get(), &detail::hash_file<Hasher>);
+        virtualtfa_reader_set_hash_userdata(handle_.get(), &hasher);
+    }
+
+#if defined(__linux__)
+    // Returns the number of bytes consumed from fd, less than max_bytes at end of input or when it would block
+    tfa_size_t read_from_fd(int fd, tfa_size_t max_bytes) {
+        tfa_size_t bytes_read = 0;
+        detail::check(virtualtfa_reader_read_from_fd(handle_.get(), fd, max_bytes, &bytes_read),
+                      "virtualtfa_reader_read_from_fd failed");
+        return bytes_read;
+    }
+#endif
+
+    void read_at(tfa_size_t offset, std::span<const char> buffer) {
+        detail::check(virtualtfa_reader_read_at(handle_.get(), offset, const_cast<char*>(buffer.data()),
+                                                buffer.size(), nullptr),
+                      "virtualtfa_reader_read_at failed");
+    }
+
+    std::vector<char> checkpoint() {
+        tfa_size_t size = 0;
+        virtualtfa_reader_checkpoint(handle_.get(), nullptr, 0, &size);
+        std::vector<char> buffer(static_cast<std::size_t>(size));
+        detail::check(virtualtfa_reader_checkpoint(handle_.get(), buffer.data(), buffer.size(), &size),
+                      "virtualtfa_reader_checkpoint failed");
+        return buffer;
+    }
+
+    void restore(std::span<const char> checkpoint) {
+        detail::check(virtualtfa_reader_restore(handle_.get(), checkpoint.data(), checkpoint.size()),
+                      "virtualtfa_reader_restore failed");
+    }
+
+    virtualtfa_reader* c_reader() const { return handle_.get(); }
+
+private:
+    detail::handle<virtualtfa_reader, virtualtfa_reader_free> handle_;
+    detail::listener_binding<Listener> listener_;
+};
+
+} // namespace virtualtfa
+
+#endif //VIRTUALTFA_HPP
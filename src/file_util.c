@@ -1,5 +1,26 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // SEEK_DATA, SEEK_HOLE
+#endif
+
 #include "file_util.h"
 
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
 #if defined(_WIN32)
 
 #include <Windows.h>
@@ -19,6 +40,9 @@ FILETIME* virtualtfa_util_convert_filetime(tfa_utime_t time) {
 }
 
 void virtualtfa_util_set_file_metadata(const char *filepath, tfa_mode_t mode, tfa_utime_t ctime, tfa_utime_t mtime) {
+    if (mtime == 0) { // the sender had no times
+        return;
+    }
     HANDLE fileHandle = CreateFileA(filepath, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
     if (fileHandle == INVALID_HANDLE_VALUE) {
         fprintf(stderr, "set_file_metadata: error opening file");
@@ -34,16 +58,345 @@ void virtualtfa_util_set_file_metadata(const char *filepath, tfa_mode_t mode, tf
     CloseHandle(fileHandle);
 }
 
-#elif defined(__linux__)
+#else
 
 void virtualtfa_util_set_file_metadata(const char *filepath, tfa_mode_t mode, tfa_utime_t ctime, tfa_utime_t mtime) {
-    // TODO: implement
+    // ctime cannot be set, the access time follows mtime, 0 when the sender had no mtime
+    (void) ctime;
+    struct timeval times[2];
+    times[0].tv_sec = (time_t) mtime;
+    times[0].tv_usec = 0;
+    times[1] = times[0];
+    if (mtime != 0 && utimes(filepath, times) != 0) {
+        fprintf(stderr, "set_file_metadata: error setting file time\n");
+    }
+    // permission bits only, setuid, setgid and sticky bits from an archive are never applied
+    if (mode != 0 && chmod(filepath, (mode_t) (mode & 0777)) != 0) { // 0 when the sender had no mode
+        fprintf(stderr, "set_file_metadata: error setting file mode\n");
+    }
 }
 
-#elif defined(__APPLE__)
+#endif
 
-void virtualtfa_util_set_file_metadata(const char *filepath, tfa_mode_t mode, tfa_utime_t ctime, tfa_utime_t mtime) {
-    // TODO: implement
+
+#if defined(_WIN32)
+
+int virtualtfa_util_fseek(FILE* file, tfa_size_t offset) {
+    return _fseeki64(file, (__int64) offset, SEEK_SET);
+}
+
+#else
+
+int virtualtfa_util_fseek(FILE* file, tfa_size_t offset) {
+    return fseeko(file, (off_t) offset, SEEK_SET);
+}
+
+#endif
+
+#if defined(_WIN32)
+
+const char* virtualtfa_util_map_file(const char* path, tfa_size_t* out_size) {
+    HANDLE fileHandle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (fileHandle == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(fileHandle, &size) || size.QuadPart == 0) {
+        CloseHandle(fileHandle);
+        return NULL;
+    }
+    HANDLE mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(fileHandle);
+    if (!mappingHandle) {
+        return NULL;
+    }
+    const char* data = (const char*) MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mappingHandle); // the view keeps the mapping alive
+    if (!data) {
+        return NULL;
+    }
+    *out_size = (tfa_size_t) size.QuadPart;
+    return data;
+}
+
+void virtualtfa_util_unmap_file(const char* data, tfa_size_t size) {
+    UnmapViewOfFile(data);
+}
+
+#else
+
+const char* virtualtfa_util_map_file(const char* path, tfa_size_t* out_size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    void* data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping stays valid
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    *out_size = (tfa_size_t) st.st_size;
+    return (const char*) data;
+}
+
+void virtualtfa_util_unmap_file(const char* data, tfa_size_t size) {
+    munmap((void*) data, (size_t) size);
+}
+
+#endif
+
+#if defined(_WIN32)
+
+#include <io.h>
+#include <sys/stat.h>
+#include <winioctl.h>
+
+int virtualtfa_util_stat_file(const char* path,
+                              tfa_size_t* out_size,
+                              tfa_utime_t* out_ctime,
+                              tfa_utime_t* out_mtime,
+                              tfa_mode_t* out_mode) {
+    struct _stat64 st;
+    if (_stat64(path, &st) != 0) {
+        return 1;
+    }
+    *out_size = (tfa_size_t) st.st_size;
+    *out_ctime = (tfa_utime_t) st.st_ctime;
+    *out_mtime = (tfa_utime_t) st.st_mtime;
+    *out_mode = (tfa_mode_t) (st.st_mode & 0777);
+    return 0;
+}
+
+int virtualtfa_util_get_data_extents(const char* path,
+                                     tfa_size_t size,
+                                     bool* out_sparse,
+                                     tfa_size_t** out_extents,
+                                     size_t* out_extents_size) {
+    *out_sparse = false;
+    *out_extents = NULL;
+    *out_extents_size = 0;
+    HANDLE fileHandle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (fileHandle == INVALID_HANDLE_VALUE) {
+        return 1;
+    }
+    // only files marked sparse can have holes
+    BY_HANDLE_FILE_INFORMATION info;
+    if (size == 0 || !GetFileInformationByHandle(fileHandle, &info) ||
+        !(info.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE)) {
+        CloseHandle(fileHandle);
+        return 0;
+    }
+
+    tfa_size_t* extents = NULL;
+    size_t extents_size = 0;
+    FILE_ALLOCATED_RANGE_BUFFER query;
+    query.FileOffset.QuadPart = 0;
+    query.Length.QuadPart = (LONGLONG) size;
+    FILE_ALLOCATED_RANGE_BUFFER ranges[64];
+    for (;;) {
+        DWORD bytesReturned = 0;
+        BOOL done = DeviceIoControl(fileHandle, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query),
+                                    ranges, sizeof(ranges), &bytesReturned, NULL);
+        if (!done && GetLastError() != ERROR_MORE_DATA) {
+            free(extents);
+            CloseHandle(fileHandle);
+            return 1;
+        }
+        size_t count = bytesReturned / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+        tfa_size_t* new_extents = (tfa_size_t*) realloc(extents, (extents_size + count + 1) * 2 * sizeof(tfa_size_t));
+        if (!new_extents) {
+            free(extents);
+            CloseHandle(fileHandle);
+            return 1;
+        }
+        extents = new_extents;
+        for (size_t i = 0; i < count; ++i) {
+            tfa_size_t offset = (tfa_size_t) ranges[i].FileOffset.QuadPart;
+            tfa_size_t length = (tfa_size_t) ranges[i].Length.QuadPart;
+            if (offset >= size) continue;
+            extents[extents_size * 2] = offset;
+            extents[extents_size * 2 + 1] = offset + length > size ? size - offset : length;
+            extents_size++;
+        }
+        if (done || count == 0) {
+            break;
+        }
+        // more ranges follow the last one returned
+        LONGLONG next = ranges[count - 1].FileOffset.QuadPart + ranges[count - 1].Length.QuadPart;
+        if ((tfa_size_t) next >= size) {
+            break;
+        }
+        query.FileOffset.QuadPart = next;
+        query.Length.QuadPart = (LONGLONG) size - next;
+    }
+    CloseHandle(fileHandle);
+
+    if (extents_size == 1 && extents[0] == 0 && extents[1] == size) { // fully allocated
+        free(extents);
+        return 0;
+    }
+    *out_sparse = true;
+    *out_extents = extents;
+    *out_extents_size = extents_size;
+    return 0;
+}
+
+int virtualtfa_util_truncate_file(FILE* file, tfa_size_t size) {
+    if (fflush(file) != 0) {
+        return 1;
+    }
+    return _chsize_s(_fileno(file), (__int64) size) != 0;
+}
+
+int virtualtfa_util_sync_file(FILE* file) {
+    if (fflush(file) != 0) {
+        return 1;
+    }
+    return _commit(_fileno(file)) != 0;
+}
+
+#else
+
+int virtualtfa_util_stat_file(const char* path,
+                              tfa_size_t* out_size,
+                              tfa_utime_t* out_ctime,
+                              tfa_utime_t* out_mtime,
+                              tfa_mode_t* out_mode) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return 1;
+    }
+    *out_size = (tfa_size_t) st.st_size;
+    *out_ctime = (tfa_utime_t) st.st_ctime;
+    *out_mtime = (tfa_utime_t) st.st_mtime;
+    *out_mode = (tfa_mode_t) (st.st_mode & 07777);
+    return 0;
+}
+
+int virtualtfa_util_get_data_extents(const char* path,
+                                     tfa_size_t size,
+                                     bool* out_sparse,
+                                     tfa_size_t** out_extents,
+                                     size_t* out_extents_size) {
+    *out_sparse = false;
+    *out_extents = NULL;
+    *out_extents_size = 0;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+    tfa_size_t* extents = NULL;
+    size_t extents_size = 0;
+    size_t extents_capacity = 0;
+    off_t data = 0;
+    while ((tfa_size_t) data < size) {
+        data = lseek(fd, data, SEEK_DATA);
+        if (data < 0 || (tfa_size_t) data >= size) { // only a hole is left
+            break;
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || (data == 0 && (tfa_size_t) hole >= size)) { // no holes, or unsupported by the filesystem
+            free(extents);
+            close(fd);
+            return 0;
+        }
+        if ((tfa_size_t) hole > size) {
+            hole = (off_t) size;
+        }
+        if (extents_size == extents_capacity) {
+            extents_capacity = extents_capacity ? extents_capacity * 2 : 16;
+            tfa_size_t* new_extents = (tfa_size_t*) realloc(extents, extents_capacity * 2 * sizeof(tfa_size_t));
+            if (!new_extents) {
+                free(extents);
+                close(fd);
+                return 1;
+            }
+            extents = new_extents;
+        }
+        extents[extents_size * 2] = (tfa_size_t) data;
+        extents[extents_size * 2 + 1] = (tfa_size_t) (hole - data);
+        extents_size++;
+        data = hole;
+    }
+    close(fd);
+    *out_sparse = size > 0;
+    *out_extents = extents;
+    *out_extents_size = extents_size;
+    if (!*out_sparse) {
+        free(extents);
+        *out_extents = NULL;
+        *out_extents_size = 0;
+    }
+#endif
+    return 0;
+}
+
+int virtualtfa_util_truncate_file(FILE* file, tfa_size_t size) {
+    if (fflush(file) != 0) {
+        return 1;
+    }
+    return ftruncate(fileno(file), (off_t) size) != 0;
+}
+
+int virtualtfa_util_sync_file(FILE* file) {
+    if (fflush(file) != 0) {
+        return 1;
+    }
+    return fsync(fileno(file)) != 0;
+}
+
+#endif
+
+#if defined(_WIN32)
+
+void virtualtfa_util_get_file_location(const char* path, uint64_t* out_physical, uint64_t* out_inode) {
+    *out_physical = UINT64_MAX;
+    *out_inode = UINT64_MAX;
+    HANDLE fileHandle = CreateFileA(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (fileHandle == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    BY_HANDLE_FILE_INFORMATION info;
+    if (GetFileInformationByHandle(fileHandle, &info)) {
+        *out_inode = ((uint64_t) info.nFileIndexHigh << 32) | info.nFileIndexLow;
+    }
+    CloseHandle(fileHandle);
+}
+
+#else
+
+void virtualtfa_util_get_file_location(const char* path, uint64_t* out_physical, uint64_t* out_inode) {
+    *out_physical = UINT64_MAX;
+    *out_inode = UINT64_MAX;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        *out_inode = (uint64_t) st.st_ino;
+    }
+#if defined(__linux__)
+    union {
+        struct fiemap map;
+        char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } fiemap;
+    memset(&fiemap, 0, sizeof(fiemap));
+    fiemap.map.fm_start = 0;
+    fiemap.map.fm_length = FIEMAP_MAX_OFFSET;
+    fiemap.map.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &fiemap.map) == 0 && fiemap.map.fm_mapped_extents > 0 &&
+        !(fiemap.map.fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))) {
+        *out_physical = fiemap.map.fm_extents[0].fe_physical;
+    }
+#endif
+    close(fd);
 }
 
 #endif
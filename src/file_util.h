@@ -3,3 +3,32 @@
 #include "virtualtfa.h"
 
 void virtualtfa_util_set_file_metadata(const char *filepath, tfa_mode_t mode, tfa_utime_t ctime, tfa_utime_t mtime);
+
+// Seek to an absolute 64-bit offset, returns 0 on success
+int virtualtfa_util_fseek(FILE* file, tfa_size_t offset);
+
+// Map a whole file read-only, returns NULL on failure
+const char* virtualtfa_util_map_file(const char* path, tfa_size_t* out_size);
+void virtualtfa_util_unmap_file(const char* data, tfa_size_t size);
+
+int virtualtfa_util_stat_file(const char* path,
+                              tfa_size_t* out_size,
+                              tfa_utime_t* out_ctime,
+                              tfa_utime_t* out_mtime,
+                              tfa_mode_t* out_mode);
+
+// Data extents of a file with holes as offset/length pairs, out_sparse is false when the file has no holes
+int virtualtfa_util_get_data_extents(const char* path,
+                                     tfa_size_t size,
+                                     bool* out_sparse,
+                                     tfa_size_t** out_extents,
+                                     size_t* out_extents_size);
+
+// Truncate or extend to size, extending leaves a hole
+int virtualtfa_util_truncate_file(FILE* file, tfa_size_t size);
+
+// Flush stdio buffers and the OS cache so the data survives a crash
+int virtualtfa_util_sync_file(FILE* file);
+
+// First physical extent and inode number of a file, UINT64_MAX when unknown
+void virtualtfa_util_get_file_location(const char* path, uint64_t* out_physical, uint64_t* out_inode);
@@ -0,0 +1,434 @@
+#include "virtualtfa.h"
+
+#include <stdlib.h>
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+/*
+ * Threading shim
+ */
+
+#if defined(_WIN32)
+
+#include <Windows.h>
+
+typedef SRWLOCK virtualtfa_mutex;
+typedef CONDITION_VARIABLE virtualtfa_cond;
+
+void virtualtfa_util_mutex_init(virtualtfa_mutex* mutex) {
+    InitializeSRWLock(mutex);
+}
+
+void virtualtfa_util_mutex_destroy(virtualtfa_mutex* mutex) {
+}
+
+void virtualtfa_util_mutex_lock(virtualtfa_mutex* mutex) {
+    AcquireSRWLockExclusive(mutex);
+}
+
+void virtualtfa_util_mutex_unlock(virtualtfa_mutex* mutex) {
+    ReleaseSRWLockExclusive(mutex);
+}
+
+void virtualtfa_util_cond_init(virtualtfa_cond* cond) {
+    InitializeConditionVariable(cond);
+}
+
+void virtualtfa_util_cond_destroy(virtualtfa_cond* cond) {
+}
+
+// Wait at most timeout_ms, or until woken when timeout_ms is negative
+void virtualtfa_util_cond_wait(virtualtfa_cond* cond, virtualtfa_mutex* mutex, int64_t timeout_ms) {
+    SleepConditionVariableSRW(cond, mutex, timeout_ms < 0 ? INFINITE : (DWORD) timeout_ms, 0);
+}
+
+void virtualtfa_util_cond_broadcast(virtualtfa_cond* cond) {
+    WakeAllConditionVariable(cond);
+}
+
+uint64_t virtualtfa_util_now_ms(void) {
+    return (uint64_t) GetTickCount64();
+}
+
+#else
+
+#include <pthread.h>
+#include <time.h>
+
+typedef pthread_mutex_t virtualtfa_mutex;
+typedef pthread_cond_t virtualtfa_cond;
+
+void virtualtfa_util_mutex_init(virtualtfa_mutex* mutex) {
+    pthread_mutex_init(mutex, NULL);
+}
+
+void virtualtfa_util_mutex_destroy(virtualtfa_mutex* mutex) {
+    pthread_mutex_destroy(mutex);
+}
+
+void virtualtfa_util_mutex_lock(virtualtfa_mutex* mutex) {
+    pthread_mutex_lock(mutex);
+}
+
+void virtualtfa_util_mutex_unlock(virtualtfa_mutex* mutex) {
+    pthread_mutex_unlock(mutex);
+}
+
+void virtualtfa_util_cond_init(virtualtfa_cond* cond) {
+    pthread_cond_init(cond, NULL);
+}
+
+void virtualtfa_util_cond_destroy(virtualtfa_cond* cond) {
+    pthread_cond_destroy(cond);
+}
+
+// Wait at most timeout_ms, or until woken when timeout_ms is negative
+void virtualtfa_util_cond_wait(virtualtfa_cond* cond, virtualtfa_mutex* mutex, int64_t timeout_ms) {
+    if (timeout_ms < 0) {
+        pthread_cond_wait(cond, mutex);
+        return;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (time_t) (timeout_ms / 1000);
+    deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(cond, mutex, &deadline);
+}
+
+void virtualtfa_util_cond_broadcast(virtualtfa_cond* cond) {
+    pthread_cond_broadcast(cond);
+}
+
+uint64_t virtualtfa_util_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+#endif
+
+/*
+ * Token bucket
+ *
+ * Tokens may go negative, a grant is made while the bucket is not in debt and the unused part of
+ * it is refunded afterwards. Bursts are capped at one second of rate.
+ */
+
+typedef struct {
+    tfa_size_t rate; // bytes per second, 0 for unlimited
+    double tokens;
+    uint64_t refilled_ms;
+} virtualtfa_bucket;
+
+void virtualtfa_util_bucket_init(virtualtfa_bucket* bucket, tfa_size_t rate) {
+    bucket->rate = rate;
+    bucket->tokens = (double) rate;
+    bucket->refilled_ms = virtualtfa_util_now_ms();
+}
+
+void virtualtfa_util_bucket_refill(virtualtfa_bucket* bucket, uint64_t now_ms) {
+    if (bucket->rate == 0) return;
+    double tokens = bucket->tokens + (double) bucket->rate * (double) (now_ms - bucket->refilled_ms) / 1000.0;
+    bucket->tokens = MIN(tokens, (double) bucket->rate);
+    bucket->refilled_ms = now_ms;
+}
+
+// Milliseconds until the bucket is out of debt, 0 if it is already
+int64_t virtualtfa_util_bucket_delay(virtualtfa_bucket* bucket) {
+    if (bucket->rate == 0 || bucket->tokens >= 0) {
+        return 0;
+    }
+    return (int64_t) (-bucket->tokens * 1000.0 / (double) bucket->rate) + 1;
+}
+
+// Negative bytes refund a grant that was not used up
+void virtualtfa_util_bucket_take(virtualtfa_bucket* bucket, double bytes) {
+    if (bucket->rate == 0) return;
+    bucket->tokens = MIN(bucket->tokens - bytes, (double) bucket->rate);
+}
+
+/*
+ * Scheduler
+ *
+ * Start-time fair queuing. A writer is backlogged from its first write until it stops calling for
+ * longer than the idle grace, finishes its archive or fails, and keeps its finish tag in between, so
+ * a writer coming straight back for its next budget keeps its place. A request gets the start tag
+ * max(virtual time, previous finish) when the writer was idle and the previous finish otherwise,
+ * and the finish tag start + budget / weight. Backlogged writers between two calls count with the
+ * start tag their next request will get. Free slots go to the writers with the smallest start
+ * tags, the global rate only to the smallest one, and the virtual time follows the start tag of
+ * the request dispatched last, so a writer gets bandwidth in proportion to its weight no matter
+ * how large its archive is.
+ */
+
+#define VIRTUALTFA_SCHEDULER_QUANTUM (64 * 1024)
+#define VIRTUALTFA_SCHEDULER_IDLE_MS 5 // a backlogged writer not calling for longer goes idle
+
+typedef struct {
+    virtualtfa_writer* writer;
+    uint32_t weight;
+    virtualtfa_bucket bucket;
+    double start_tag; // of the waiting request
+    double finish_tag; // of the last request
+    bool backlogged;
+    bool waiting;
+    bool serving;
+    uint64_t idle_since_ms; // last completion, for the idle grace
+} virtualtfa_scheduler_client;
+
+struct _virtualtfa_scheduler {
+    virtualtfa_mutex mutex;
+    virtualtfa_cond cond;
+    virtualtfa_bucket bucket;
+    int max_concurrency; // 0 for unlimited
+    int active; // writes in progress
+    tfa_size_t quantum;
+    double virtual_time;
+    virtualtfa_scheduler_client** clients;
+    size_t clients_size;
+};
+
+virtualtfa_scheduler* virtualtfa_scheduler_new() {
+    virtualtfa_scheduler* this = (virtualtfa_scheduler*) malloc(sizeof(virtualtfa_scheduler));
+    if (this) {
+        virtualtfa_util_mutex_init(&this->mutex);
+        virtualtfa_util_cond_init(&this->cond);
+        virtualtfa_util_bucket_init(&this->bucket, 0);
+        this->max_concurrency = 0;
+        this->active = 0;
+        this->quantum = VIRTUALTFA_SCHEDULER_QUANTUM;
+        this->virtual_time = 0;
+        this->clients = NULL;
+        this->clients_size = 0;
+    }
+    return this;
+}
+
+void virtualtfa_scheduler_free(virtualtfa_scheduler* this) {
+    if (this) {
+        for (size_t i = 0; i < this->clients_size; ++i) {
+            free(this->clients[i]);
+        }
+        free(this->clients);
+        virtualtfa_util_cond_destroy(&this->cond);
+        virtualtfa_util_mutex_destroy(&this->mutex);
+        free(this);
+    }
+}
+
+tfa_size_t virtualtfa_scheduler_get_rate(virtualtfa_scheduler* this) {
+    virtualtfa_util_mutex_lock(&this->mutex);
+    tfa_size_t rate = this->bucket.rate;
+    virtualtfa_util_mutex_unlock(&this->mutex);
+    return rate;
+}
+
+void virtualtfa_scheduler_set_rate(virtualtfa_scheduler* this, tfa_size_t rate) {
+    virtualtfa_util_mutex_lock(&this->mutex);
+    virtualtfa_util_bucket_init(&this->bucket, rate);
+    virtualtfa_util_cond_broadcast(&this->cond);
+    virtualtfa_util_mutex_unlock(&this->mutex);
+}
+
+int virtualtfa_scheduler_get_max_concurrency(virtualtfa_scheduler* this) {
+    virtualtfa_util_mutex_lock(&this->mutex);
+    int max_concurrency = this->max_concurrency;
+    virtualtfa_util_mutex_unlock(&this->mutex);
+    return max_concurrency;
+}
+
+void virtualtfa_scheduler_set_max_concurrency(virtualtfa_scheduler* this, int max_concurrency) {
+    virtualtfa_util_mutex_lock(&this->mutex);
+    this->max_concurrency = max_concurrency;
+    virtualtfa_util_cond_broadcast(&this->cond);
+    virtualtfa_util_mutex_unlock(&this->mutex);
+}
+
+tfa_size_t virtualtfa_scheduler_get_quantum(virtualtfa_scheduler* this) {
+    virtualtfa_util_mutex_lock(&this->mutex);
+    tfa_size_t quantum = this->quantum;
+    virtualtfa_util_mutex_unlock(&this->mutex);
+    return quantum;
+}
+
+void virtualtfa_scheduler_set_quantum(virtualtfa_scheduler* this, tfa_size_t quantum) {
+    virtualtfa_util_mutex_lock(&this->mutex);
+    this->quantum = quantum ? quantum : VIRTUALTFA_SCHEDULER_QUANTUM;
+    virtualtfa_util_mutex_unlock(&this->mutex);
+}
+
+virtualtfa_scheduler_client* virtualtfa_util_scheduler_find(virtualtfa_scheduler* this, virtualtfa_writer* writer) {
+    for (size_t i = 0; i < this->clients_size; ++i) {
+        if (this->clients[i]->writer == writer) {
+            return this->clients[i];
+        }
+    }
+    return NULL;
+}
+
+int virtualtfa_scheduler_register(virtualtfa_scheduler* this, virtualtfa_writer* writer, uint32_t weight, tfa_size_t rate) {
+    virtualtfa_scheduler_client* client = (virtualtfa_scheduler_client*) malloc(sizeof(virtualtfa_scheduler_client));
+    if (!client) {
+        fprintf(stderr, "virtualtfa_scheduler_register: memory allocation failed\n");
+        return 1;
+    }
+    client->writer = writer;
+    client->weight = weight ? weight : 1;
+    virtualtfa_util_bucket_init(&client->bucket, rate);
+    client->start_tag = 0;
+    client->finish_tag = 0;
+    client->backlogged = false;
+    client->waiting = false;
+    client->serving = false;
+    client->idle_since_ms = 0;
+
+    virtualtfa_util_mutex_lock(&this->mutex);
+    if (virtualtfa_util_scheduler_find(this, writer)) {
+        virtualtfa_util_mutex_unlock(&this->mutex);
+        fprintf(stderr, "virtualtfa_scheduler_register: writer is already registered\n");
+        free(client);
+        return 1;
+    }
+    virtualtfa_scheduler_client** new_clients = (virtualtfa_scheduler_client**) realloc(
+            this->clients, (this->clients_size + 1) * sizeof(virtualtfa_scheduler_client*));
+    if (!new_clients) {
+        virtualtfa_util_mutex_unlock(&this->mutex);
+        fprintf(stderr, "virtualtfa_scheduler_register: memory allocation failed\n");
+        free(client);
+        return 1;
+    }
+    this->clients = new_clients;
+    this->clients[this->clients_size++] = client;
+    virtualtfa_util_mutex_unlock(&this->mutex);
+    return 0;
+}
+
+void virtualtfa_scheduler_unregister(virtualtfa_scheduler* this, virtualtfa_writer* writer) {
+    virtualtfa_util_mutex_lock(&this->mutex);
+    for (size_t i = 0; i < this->clients_size; ++i) {
+        if (this->clients[i]->writer == writer) {
+            free(this->clients[i]);
+            this->clients[i] = this->clients[--this->clients_size];
+            break;
+        }
+    }
+    virtualtfa_util_cond_broadcast(&this->cond); // writers may have been holding back for it
+    virtualtfa_util_mutex_unlock(&this->mutex);
+}
+
+// Start tag of the client's waiting or next request
+double virtualtfa_util_scheduler_key(virtualtfa_scheduler_client* client) {
+    return client->waiting ? client->start_tag : client->finish_tag;
+}
+
+int virtualtfa_scheduler_write(virtualtfa_scheduler* this,
+                               virtualtfa_writer* writer,
+                               char* buffer,
+                               tfa_size_t buffer_size,
+                               tfa_size_t* out_bytes_written) {
+    virtualtfa_util_mutex_lock(&this->mutex);
+    virtualtfa_scheduler_client* client = virtualtfa_util_scheduler_find(this, writer);
+    if (!client) {
+        virtualtfa_util_mutex_unlock(&this->mutex);
+        fprintf(stderr, "virtualtfa_scheduler_write: writer is not registered\n");
+        return 1;
+    }
+
+    tfa_size_t budget = MIN(buffer_size, this->quantum);
+    client->start_tag = client->backlogged ? client->finish_tag : MAX(this->virtual_time, client->finish_tag);
+    client->finish_tag = client->start_tag + (double) budget / client->weight;
+    client->backlogged = true;
+    client->waiting = true;
+
+    for (;;) {
+        uint64_t now_ms = virtualtfa_util_now_ms();
+        virtualtfa_util_bucket_refill(&this->bucket, now_ms);
+        virtualtfa_util_bucket_refill(&client->bucket, now_ms);
+        int64_t own_delay = virtualtfa_util_bucket_delay(&client->bucket);
+
+        // Backlogged writers within their own rate that come before this one
+        double key = client->start_tag;
+        bool self_seen = false;
+        size_t ahead = 0; // waiting or about to call again
+        bool ahead_serving = false;
+        int64_t grace_ms = -1; // until the first writer ahead between two calls goes idle
+        for (size_t i = 0; i < this->clients_size; ++i) {
+            virtualtfa_scheduler_client* other = this->clients[i];
+            if (other == client) {
+                self_seen = true;
+                continue;
+            }
+            if (!other->backlogged) continue;
+            if (!other->waiting && !other->serving && now_ms - other->idle_since_ms >= VIRTUALTFA_SCHEDULER_IDLE_MS) {
+                other->backlogged = false;
+                continue;
+            }
+            virtualtfa_util_bucket_refill(&other->bucket, now_ms);
+            if (virtualtfa_util_bucket_delay(&other->bucket) > 0) continue;
+            double other_key = virtualtfa_util_scheduler_key(other);
+            if (other_key > key || (other_key == key && self_seen)) continue; // ties go in list order
+            if (other->serving) {
+                ahead_serving = true;
+                continue;
+            }
+            ahead++;
+            if (!other->waiting) {
+                int64_t left_ms = (int64_t) (other->idle_since_ms + VIRTUALTFA_SCHEDULER_IDLE_MS - now_ms);
+                grace_ms = grace_ms < 0 ? left_ms : MIN(grace_ms, left_ms);
+            }
+        }
+
+        int64_t timeout_ms = -1; // until another writer is dispatched or finishes
+        if (own_delay > 0) {
+            timeout_ms = own_delay;
+        } else {
+            bool slot = this->max_concurrency == 0 || (int) ahead < this->max_concurrency - this->active;
+            bool turn = this->bucket.rate == 0 || (ahead == 0 && !ahead_serving);
+            int64_t rate_delay = this->bucket.rate == 0 ? 0 : virtualtfa_util_bucket_delay(&this->bucket);
+            if (slot && turn && rate_delay == 0) {
+                break;
+            }
+            if (slot && turn) {
+                timeout_ms = rate_delay;
+            }
+            if (grace_ms >= 0 && (timeout_ms < 0 || grace_ms < timeout_ms)) {
+                timeout_ms = grace_ms;
+            }
+        }
+        virtualtfa_util_cond_wait(&this->cond, &this->mutex, timeout_ms);
+    }
+
+    client->waiting = false;
+    client->serving = true;
+    this->virtual_time = MAX(this->virtual_time, client->start_tag);
+    this->active++;
+    virtualtfa_util_bucket_take(&this->bucket, (double) budget);
+    virtualtfa_util_bucket_take(&client->bucket, (double) budget);
+    virtualtfa_util_cond_broadcast(&this->cond); // the next writer in line may go now
+    virtualtfa_util_mutex_unlock(&this->mutex);
+
+    tfa_size_t bytes_written = 0;
+    int result = virtualtfa_writer_write(writer, buffer, budget, &bytes_written);
+
+    virtualtfa_util_mutex_lock(&this->mutex);
+    this->active--;
+    client->serving = false;
+    client->idle_since_ms = virtualtfa_util_now_ms();
+    if (result != 0 || bytes_written == 0) { // nothing more to come
+        client->backlogged = false;
+    }
+    virtualtfa_util_bucket_take(&this->bucket, -(double) (budget - bytes_written));
+    virtualtfa_util_bucket_take(&client->bucket, -(double) (budget - bytes_written));
+    virtualtfa_util_cond_broadcast(&this->cond);
+    virtualtfa_util_mutex_unlock(&this->mutex);
+
+    if (out_bytes_written) {
+        *out_bytes_written = bytes_written;
+    }
+    return result;
+}
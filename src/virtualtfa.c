@@ -1,3 +1,7 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // splice
+#endif
+
 #include "virtualtfa.h"
 
 #include "file_util.h"
@@ -5,9 +9,10 @@
 #include <stdlib.h>
 #include <string.h>
 
-#if (defined(_WIN32) || defined(_WIN64))
-#pragma comment(lib, "ws2_32.lib")
-#include <winsock2.h> // endian swap
+#if defined(__linux__)
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
 typedef uint32_t tfa_namesize_t;
@@ -33,49 +38,53 @@ typedef struct _tfa_header {
 
 static tfa_size_t tfa_header_size = sizeof(tfa_header); // 48
 
+#define VIRTUALTFA_VERSION 0
+
 /*
  * Utility
  */
 
-// Write big-endian 32-bit signed integer
-void virtualtfa_util_write_i32(char* buf, int32_t value) {
-    uint32_t data = htonl((uint32_t) value);
-    memcpy(buf, &data, 4);
-}
-
-// Read big-endian 32-bit signed integer
-int32_t virtualtfa_util_read_i32(const char* buf) {
-    uint32_t data;
-    memcpy(&data, buf, 4);
-    data = ntohl(data);
-    return (int32_t) data;
-}
-
 // Write big-endian 32-bit unsigned integer
 void virtualtfa_util_write_u32(char* buf, uint32_t value) {
-    value = htonl(value);
-    memcpy(buf, &value, 4);
+    for (int i = 3; i >= 0; --i) {
+        buf[i] = (char) (value & 0xFF);
+        value >>= 8;
+    }
 }
 
 // Read big-endian 32-bit unsigned integer
 uint32_t virtualtfa_util_read_u32(const char* buf) {
-    uint32_t data;
-    memcpy(&data, buf, 4);
-    data = ntohl(data);
+    uint32_t data = 0;
+    for (int i = 0; i < 4; ++i) {
+        data = (data << 8) | (uint8_t) buf[i];
+    }
     return data;
 }
 
+// Write big-endian 32-bit signed integer
+void virtualtfa_util_write_i32(char* buf, int32_t value) {
+    virtualtfa_util_write_u32(buf, (uint32_t) value);
+}
+
+// Read big-endian 32-bit signed integer
+int32_t virtualtfa_util_read_i32(const char* buf) {
+    return (int32_t) virtualtfa_util_read_u32(buf);
+}
+
 // Write big-endian 64-bit unsigned integer
 void virtualtfa_util_write_u64(char* buf, uint64_t value) {
-    value = htonll(value);
-    memcpy(buf, &value, 8);
+    for (int i = 7; i >= 0; --i) {
+        buf[i] = (char) (value & 0xFF);
+        value >>= 8;
+    }
 }
 
 // Read big-endian 64-bit unsigned integer
 uint64_t virtualtfa_util_read_u64(const char* buf) {
-    uint64_t data;
-    memcpy(&data, buf, 8);
-    data = ntohll(data);
+    uint64_t data = 0;
+    for (int i = 0; i < 8; ++i) {
+        data = (data << 8) | (uint8_t) buf[i];
+    }
     return data;
 }
 
@@ -88,6 +97,8 @@ struct _virtualtfa_input_stream {
     void* read_userdata;
     virtualtfa_close_function close_function;
     void* close_userdata;
+    virtualtfa_seek_function seek_function;
+    void* seek_userdata;
 };
 
 virtualtfa_input_stream* virtualtfa_input_stream_new() {
@@ -97,6 +108,8 @@ virtualtfa_input_stream* virtualtfa_input_stream_new() {
         this->read_userdata = NULL;
         this->close_function = NULL;
         this->close_userdata = NULL;
+        this->seek_function = NULL;
+        this->seek_userdata = NULL;
     }
     return this;
 }
@@ -141,6 +154,22 @@ void virtualtfa_input_stream_set_close_userdata(virtualtfa_input_stream* this, v
     this->close_userdata = userdata;
 }
 
+virtualtfa_seek_function virtualtfa_input_stream_get_seek_function(virtualtfa_input_stream* this) {
+    return this->seek_function;
+}
+
+void virtualtfa_input_stream_set_seek_function(virtualtfa_input_stream* this, virtualtfa_seek_function seek_function) {
+    this->seek_function = seek_function;
+}
+
+void* virtualtfa_input_stream_get_seek_userdata(virtualtfa_input_stream* this) {
+    return this->seek_userdata;
+}
+
+void virtualtfa_input_stream_set_seek_userdata(virtualtfa_input_stream* this, void* userdata) {
+    this->seek_userdata = userdata;
+}
+
 int virtualtfa_input_stream_read(virtualtfa_input_stream* this,
                                   char* buffer,
                                   tfa_size_t buffer_size,
@@ -152,6 +181,35 @@ int virtualtfa_input_stream_read(virtualtfa_input_stream* this,
     return 0;
 }
 
+// Read exactly buffer_size bytes, read functions may return less per call. Input ending early is an error.
+int virtualtfa_util_input_stream_read_full(virtualtfa_input_stream* this, char* buffer, tfa_size_t buffer_size) {
+    while (buffer_size > 0) {
+        tfa_size_t read_bytes = this->read_function(this->read_userdata, buffer, buffer_size);
+        if (read_bytes == 0) {
+            return 1;
+        }
+        buffer += read_bytes;
+        buffer_size -= read_bytes;
+    }
+    return 0;
+}
+
+int virtualtfa_input_stream_seek(virtualtfa_input_stream* this, tfa_size_t offset) {
+    if (this->seek_function) {
+        return this->seek_function(this->seek_userdata, offset);
+    }
+    // No seek function, assume a freshly opened stream and discard bytes up to offset
+    char discard[4096];
+    while (offset > 0) {
+        tfa_size_t read_bytes = this->read_function(this->read_userdata, discard, MIN(offset, sizeof(discard)));
+        if (read_bytes == 0) {
+            return 1;
+        }
+        offset -= read_bytes;
+    }
+    return 0;
+}
+
 void virtualtfa_input_stream_close(virtualtfa_input_stream* this) {
     if (this->close_function) {
         this->close_function(this->close_userdata);
@@ -170,6 +228,11 @@ struct _virtualtfa_entry {
     tfa_utime_t ctime;
     tfa_utime_t mtime;
     tfa_mode_t mode;
+    tfa_typeflag_t typeflag;
+    uint64_t hash;
+    char* path; // set by virtualtfa_entry_set_file
+    char* sparse_map; // encoded extent map of a sparse file
+    tfa_size_t sparse_map_size;
 };
 
 virtualtfa_entry* virtualtfa_entry_new() {
@@ -182,12 +245,19 @@ virtualtfa_entry* virtualtfa_entry_new() {
         this->ctime = 0;
         this->mtime = 0;
         this->mode = 0;
+        this->typeflag = VIRTUALTFA_TYPEFLAG_FILE;
+        this->hash = 0;
+        this->path = NULL;
+        this->sparse_map = NULL;
+        this->sparse_map_size = 0;
     }
     return this;
 }
 
 void virtualtfa_entry_free(virtualtfa_entry* this) {
     if (this) {
+        free(this->path);
+        free(this->sparse_map);
         free(this);
     }
 }
@@ -249,6 +319,187 @@ void virtualtfa_entry_set_mode(virtualtfa_entry* this, tfa_mode_t mode) {
     this->mode = mode;
 }
 
+tfa_typeflag_t virtualtfa_entry_get_typeflag(virtualtfa_entry* this) {
+    return this->typeflag;
+}
+
+void virtualtfa_entry_set_typeflag(virtualtfa_entry* this, tfa_typeflag_t typeflag) {
+    this->typeflag = typeflag;
+}
+
+uint64_t virtualtfa_entry_get_hash(virtualtfa_entry* this) {
+    return this->hash;
+}
+
+void virtualtfa_entry_set_hash(virtualtfa_entry* this, uint64_t hash) {
+    this->hash = hash;
+}
+
+/*
+ * File Input Stream
+ *
+ * Sparse files are streamed as their extent map (see README.md) followed by the data extents only.
+ */
+
+static tfa_size_t tfa_sparse_map_header_size = 8 + 4; // logical size, extent count
+static tfa_size_t tfa_sparse_extent_size = 8 + 8; // offset, length
+
+typedef struct _virtualtfa_file_stream {
+    FILE* file;
+    virtualtfa_entry* entry;
+    tfa_size_t pos; // position in the streamed data
+    uint32_t extent; // current extent of a sparse file
+    tfa_size_t extent_pos;
+} virtualtfa_file_stream;
+
+tfa_size_t virtualtfa_util_file_stream_read(void* userdata, char* buffer, tfa_size_t buffer_size) {
+    virtualtfa_file_stream* stream = (virtualtfa_file_stream*) userdata;
+    virtualtfa_entry* entry = stream->entry;
+    if (!entry->sparse_map) {
+        return fread(buffer, 1, buffer_size, stream->file);
+    }
+
+    tfa_size_t bytes_read = 0;
+    if (stream->pos < entry->sparse_map_size) {
+        bytes_read = MIN(entry->sparse_map_size - stream->pos, buffer_size);
+        memcpy(buffer, entry->sparse_map + stream->pos, bytes_read);
+        stream->pos += bytes_read;
+    }
+    uint32_t extents_size = virtualtfa_util_read_u32(entry->sparse_map + 8);
+    while (bytes_read < buffer_size && stream->extent < extents_size) {
+        const char* extent = entry->sparse_map + tfa_sparse_map_header_size + stream->extent * tfa_sparse_extent_size;
+        tfa_size_t extent_offset = virtualtfa_util_read_u64(extent);
+        tfa_size_t extent_length = virtualtfa_util_read_u64(extent + 8);
+        if (stream->extent_pos == extent_length) {
+            stream->extent++;
+            stream->extent_pos = 0;
+            continue;
+        }
+        if (virtualtfa_util_fseek(stream->file, extent_offset + stream->extent_pos) != 0) {
+            break;
+        }
+        tfa_size_t to_read = MIN(extent_length - stream->extent_pos, buffer_size - bytes_read);
+        tfa_size_t extent_read = fread(buffer + bytes_read, 1, to_read, stream->file);
+        bytes_read += extent_read;
+        stream->pos += extent_read;
+        stream->extent_pos += extent_read;
+        if (extent_read < to_read) break;
+    }
+    return bytes_read;
+}
+
+int virtualtfa_util_file_stream_seek(void* userdata, tfa_size_t offset) {
+    virtualtfa_file_stream* stream = (virtualtfa_file_stream*) userdata;
+    virtualtfa_entry* entry = stream->entry;
+    if (!entry->sparse_map) {
+        return virtualtfa_util_fseek(stream->file, offset);
+    }
+    stream->pos = offset;
+    stream->extent = 0;
+    stream->extent_pos = 0;
+    if (offset <= entry->sparse_map_size) {
+        return 0;
+    }
+    tfa_size_t data_offset = offset - entry->sparse_map_size;
+    uint32_t extents_size = virtualtfa_util_read_u32(entry->sparse_map + 8);
+    for (; stream->extent < extents_size; ++stream->extent) {
+        const char* extent = entry->sparse_map + tfa_sparse_map_header_size + stream->extent * tfa_sparse_extent_size;
+        tfa_size_t extent_length = virtualtfa_util_read_u64(extent + 8);
+        if (data_offset < extent_length) {
+            stream->extent_pos = data_offset;
+            return 0;
+        }
+        data_offset -= extent_length;
+    }
+    return data_offset == 0 ? 0 : 1;
+}
+
+void virtualtfa_util_file_stream_close(void* userdata) {
+    virtualtfa_file_stream* stream = (virtualtfa_file_stream*) userdata;
+    fclose(stream->file);
+    free(stream);
+}
+
+virtualtfa_input_stream* virtualtfa_util_file_stream_supplier(void* userdata) {
+    virtualtfa_entry* entry = (virtualtfa_entry*) userdata;
+    virtualtfa_file_stream* file_stream = (virtualtfa_file_stream*) malloc(sizeof(virtualtfa_file_stream));
+    virtualtfa_input_stream* stream = virtualtfa_input_stream_new();
+    if (!file_stream || !stream || !(file_stream->file = fopen(entry->path, "rb"))) {
+        fprintf(stderr, "virtualtfa_file_stream: failed to open the file %s\n", entry->path);
+        free(file_stream);
+        virtualtfa_input_stream_free(stream);
+        return NULL;
+    }
+    file_stream->entry = entry;
+    file_stream->pos = 0;
+    file_stream->extent = 0;
+    file_stream->extent_pos = 0;
+    virtualtfa_input_stream_set_read_function(stream, virtualtfa_util_file_stream_read);
+    virtualtfa_input_stream_set_read_userdata(stream, file_stream);
+    virtualtfa_input_stream_set_seek_function(stream, virtualtfa_util_file_stream_seek);
+    virtualtfa_input_stream_set_seek_userdata(stream, file_stream);
+    virtualtfa_input_stream_set_close_function(stream, virtualtfa_util_file_stream_close);
+    virtualtfa_input_stream_set_close_userdata(stream, file_stream);
+    return stream;
+}
+
+int virtualtfa_entry_set_file(virtualtfa_entry* this, const char* path) {
+    tfa_size_t size;
+    if (virtualtfa_util_stat_file(path, &size, &this->ctime, &this->mtime, &this->mode) != 0) {
+        fprintf(stderr, "virtualtfa_entry_set_file: failed to stat the file %s\n", path);
+        return 1;
+    }
+    bool sparse;
+    tfa_size_t* extents;
+    size_t extents_size;
+    if (virtualtfa_util_get_data_extents(path, size, &sparse, &extents, &extents_size) != 0) {
+        sparse = false; // stream every byte
+    }
+    if (sparse && extents_size > UINT32_MAX) { // more extents than the map can count, stream every byte
+        free(extents);
+        extents = NULL;
+        sparse = false;
+    }
+
+    char* path_copy = strdup(path);
+    char* sparse_map = NULL;
+    tfa_size_t sparse_map_size = 0;
+    if (sparse) {
+        sparse_map_size = tfa_sparse_map_header_size + extents_size * tfa_sparse_extent_size;
+        sparse_map = (char*) malloc(sparse_map_size);
+    }
+    if (!path_copy || (sparse && !sparse_map)) {
+        fprintf(stderr, "virtualtfa_entry_set_file: memory allocation failed\n");
+        free(path_copy);
+        free(extents);
+        return 1;
+    }
+
+    free(this->path);
+    free(this->sparse_map);
+    this->path = path_copy;
+    this->sparse_map = sparse_map;
+    this->sparse_map_size = sparse_map_size;
+    this->typeflag = VIRTUALTFA_TYPEFLAG_FILE;
+    this->size = size;
+    if (sparse_map) {
+        this->typeflag = VIRTUALTFA_TYPEFLAG_SPARSE;
+        this->size = sparse_map_size;
+        virtualtfa_util_write_u64(sparse_map, size);
+        virtualtfa_util_write_u32(sparse_map + 8, (uint32_t) extents_size);
+        for (size_t i = 0; i < extents_size; ++i) {
+            char* extent = sparse_map + tfa_sparse_map_header_size + i * tfa_sparse_extent_size;
+            virtualtfa_util_write_u64(extent, extents[i * 2]);
+            virtualtfa_util_write_u64(extent + 8, extents[i * 2 + 1]);
+            this->size += extents[i * 2 + 1];
+        }
+    }
+    free(extents);
+    this->stream_supplier = virtualtfa_util_file_stream_supplier;
+    this->stream_supplier_userdata = this;
+    return 0;
+}
+
 /*
  * Archive
  */
@@ -256,6 +507,15 @@ void virtualtfa_entry_set_mode(virtualtfa_entry* this, tfa_mode_t mode) {
 struct _virtualtfa_archive {
     virtualtfa_entry** entries;
     size_t entries_size;
+    virtualtfa_entry** owned_entries; // entries created by the library, freed with the archive
+    size_t owned_entries_size;
+
+    // Set by virtualtfa_archive_freeze
+    bool frozen;
+    char* meta; // header and name of every entry back to back
+    tfa_size_t* meta_offsets; // entries_size + 1 offsets into meta
+    tfa_size_t* positions; // archive position of every entry, NULL with chunked entries
+    tfa_size_t size;
 };
 
 virtualtfa_archive* virtualtfa_archive_new() {
@@ -263,17 +523,36 @@ virtualtfa_archive* virtualtfa_archive_new() {
     if (this) {
         this->entries = NULL;
         this->entries_size = 0;
+        this->owned_entries = NULL;
+        this->owned_entries_size = 0;
+        this->frozen = false;
+        this->meta = NULL;
+        this->meta_offsets = NULL;
+        this->positions = NULL;
+        this->size = 0;
     }
     return this;
 }
 
 void virtualtfa_archive_free(virtualtfa_archive* this) {
     if (this) {
+        for (size_t i = 0; i < this->owned_entries_size; ++i) {
+            virtualtfa_entry_free(this->owned_entries[i]);
+        }
+        free(this->owned_entries);
+        free(this->entries);
+        free(this->meta);
+        free(this->meta_offsets);
+        free(this->positions);
         free(this);
     }
 }
 
 void virtualtfa_archive_add(virtualtfa_archive* this, virtualtfa_entry* entry) {
+    if (this->frozen) {
+        fprintf(stderr, "virtualtfa_archive_add: archive is frozen\n");
+        return;
+    }
     this->entries_size++;
     virtualtfa_entry** new_entries = (virtualtfa_entry**) realloc(this->entries,
                                                                     this->entries_size * sizeof(virtualtfa_entry*));
@@ -285,6 +564,314 @@ void virtualtfa_archive_add(virtualtfa_archive* this, virtualtfa_entry* entry) {
     this->entries[this->entries_size - 1] = entry;
 }
 
+int virtualtfa_util_archive_add_owned(virtualtfa_archive* this, virtualtfa_entry* entry) {
+    virtualtfa_entry** new_owned_entries = (virtualtfa_entry**) realloc(this->owned_entries,
+                                                                          (this->owned_entries_size + 1) *
+                                                                          sizeof(virtualtfa_entry*));
+    if (!new_owned_entries) {
+        fprintf(stderr, "virtualtfa_archive_add: memory allocation failed\n");
+        virtualtfa_entry_free(entry);
+        return 1;
+    }
+    this->owned_entries = new_owned_entries;
+    this->owned_entries[this->owned_entries_size++] = entry;
+    virtualtfa_archive_add(this, entry);
+    return 0;
+}
+
+/*
+ * Manifest
+ *
+ * | magic "tfamf" | version | count |
+ * followed by count records:
+ * | namesize (4) | size (8) | mtime (8) | hash (8) | name | \0 |
+ */
+
+const char virtualtfa_manifest_magic[5] = {'t', 'f', 'a', 'm', 'f'};
+
+#define VIRTUALTFA_MANIFEST_VERSION 0
+
+static tfa_size_t tfa_manifest_header_size = 5 + 1 + 8;
+static tfa_size_t tfa_manifest_record_size = 4 + 8 + 8 + 8; // without name
+
+struct _virtualtfa_manifest {
+    const char* data; // mapped file
+    tfa_size_t data_size;
+    tfa_size_t* records; // record offsets in data
+    size_t records_size;
+    size_t* index; // open addressing hash table of record index + 1, 0 is empty
+    size_t index_mask;
+};
+
+// FNV-1a
+uint64_t virtualtfa_util_hash_name(const char* name, size_t namesize) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < namesize; ++i) {
+        hash ^= (uint8_t) name[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+const char* virtualtfa_util_manifest_record_name(virtualtfa_manifest* this, size_t record, tfa_namesize_t* out_namesize) {
+    const char* record_ptr = this->data + this->records[record];
+    *out_namesize = virtualtfa_util_read_u32(record_ptr);
+    return record_ptr + tfa_manifest_record_size;
+}
+
+// Returns record index or SIZE_MAX
+size_t virtualtfa_util_manifest_find(virtualtfa_manifest* this, const char* name, size_t namesize) {
+    size_t slot = (size_t) virtualtfa_util_hash_name(name, namesize) & this->index_mask;
+    while (this->index[slot] != 0) {
+        size_t record = this->index[slot] - 1;
+        tfa_namesize_t record_namesize;
+        const char* record_name = virtualtfa_util_manifest_record_name(this, record, &record_namesize);
+        if (record_namesize == namesize && memcmp(record_name, name, namesize) == 0) {
+            return record;
+        }
+        slot = (slot + 1) & this->index_mask;
+    }
+    return SIZE_MAX;
+}
+
+virtualtfa_manifest* virtualtfa_manifest_open(const char* path) {
+    tfa_size_t data_size;
+    const char* data = virtualtfa_util_map_file(path, &data_size);
+    if (!data) {
+        fprintf(stderr, "virtualtfa_manifest_open: failed to map the file %s\n", path);
+        return NULL;
+    }
+    if (data_size < tfa_manifest_header_size ||
+        memcmp(data, virtualtfa_manifest_magic, sizeof(virtualtfa_manifest_magic)) != 0 ||
+        data[sizeof(virtualtfa_manifest_magic)] != VIRTUALTFA_MANIFEST_VERSION) {
+        fprintf(stderr, "virtualtfa_manifest_open: invalid manifest\n");
+        virtualtfa_util_unmap_file(data, data_size);
+        return NULL;
+    }
+    tfa_size_t count = virtualtfa_util_read_u64(data + sizeof(virtualtfa_manifest_magic) + 1);
+    if (count > (data_size - tfa_manifest_header_size) / (tfa_manifest_record_size + 1)) {
+        fprintf(stderr, "virtualtfa_manifest_open: truncated manifest\n");
+        virtualtfa_util_unmap_file(data, data_size);
+        return NULL;
+    }
+
+    size_t index_size = 16;
+    while (index_size < count * 2) { // keep the load factor under 0.5
+        index_size <<= 1;
+    }
+    virtualtfa_manifest* this = (virtualtfa_manifest*) malloc(sizeof(virtualtfa_manifest));
+    tfa_size_t* records = (tfa_size_t*) malloc((count ? count : 1) * sizeof(tfa_size_t));
+    size_t* index = (size_t*) calloc(index_size, sizeof(size_t));
+    if (!this || !records || !index) {
+        fprintf(stderr, "virtualtfa_manifest_open: memory allocation failed\n");
+        free(this);
+        free(records);
+        free(index);
+        virtualtfa_util_unmap_file(data, data_size);
+        return NULL;
+    }
+    this->data = data;
+    this->data_size = data_size;
+    this->records = records;
+    this->records_size = 0;
+    this->index = index;
+    this->index_mask = index_size - 1;
+
+    tfa_size_t cursor = tfa_manifest_header_size;
+    for (tfa_size_t i = 0; i < count; ++i) {
+        if (data_size - cursor < tfa_manifest_record_size + 1) {
+            fprintf(stderr, "virtualtfa_manifest_open: truncated manifest\n");
+            virtualtfa_manifest_free(this);
+            return NULL;
+        }
+        tfa_namesize_t namesize = virtualtfa_util_read_u32(data + cursor);
+        if (data_size - cursor - tfa_manifest_record_size <= namesize ||
+            data[cursor + tfa_manifest_record_size + namesize] != '\0') {
+            fprintf(stderr, "virtualtfa_manifest_open: truncated manifest\n");
+            virtualtfa_manifest_free(this);
+            return NULL;
+        }
+        const char* name = data + cursor + tfa_manifest_record_size;
+        if (virtualtfa_util_manifest_find(this, name, namesize) == SIZE_MAX) { // first record wins
+            size_t slot = (size_t) virtualtfa_util_hash_name(name, namesize) & this->index_mask;
+            while (this->index[slot] != 0) {
+                slot = (slot + 1) & this->index_mask;
+            }
+            this->index[slot] = this->records_size + 1;
+        }
+        this->records[this->records_size++] = cursor;
+        cursor += tfa_manifest_record_size + namesize + 1;
+    }
+    return this;
+}
+
+void virtualtfa_manifest_free(virtualtfa_manifest* this) {
+    if (this) {
+        virtualtfa_util_unmap_file(this->data, this->data_size);
+        free(this->records);
+        free(this->index);
+        free(this);
+    }
+}
+
+int virtualtfa_archive_write_manifest(virtualtfa_archive* this, const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "virtualtfa_archive_write_manifest: failed to open the file %s\n", path);
+        return 1;
+    }
+    tfa_size_t count = 0;
+    for (size_t i = 0; i < this->entries_size; ++i) {
+        if (this->entries[i] && this->entries[i]->typeflag != VIRTUALTFA_TYPEFLAG_DELETED) {
+            count++;
+        }
+    }
+    char buf[4 + 8 + 8 + 8]; // record without name, large enough for the manifest header too
+    memcpy(buf, virtualtfa_manifest_magic, sizeof(virtualtfa_manifest_magic));
+    buf[sizeof(virtualtfa_manifest_magic)] = VIRTUALTFA_MANIFEST_VERSION;
+    virtualtfa_util_write_u64(buf + sizeof(virtualtfa_manifest_magic) + 1, count);
+    int error = fwrite(buf, 1, tfa_manifest_header_size, file) != tfa_manifest_header_size;
+    for (size_t i = 0; i < this->entries_size && !error; ++i) {
+        virtualtfa_entry* entry = this->entries[i];
+        if (!entry || entry->typeflag == VIRTUALTFA_TYPEFLAG_DELETED) continue;
+        tfa_namesize_t namesize = (tfa_namesize_t) strlen(entry->name);
+        virtualtfa_util_write_u32(buf, namesize);
+        virtualtfa_util_write_u64(buf + 4, entry->size);
+        virtualtfa_util_write_u64(buf + 4 + 8, entry->mtime);
+        virtualtfa_util_write_u64(buf + 4 + 8 + 8, entry->hash);
+        error = fwrite(buf, 1, tfa_manifest_record_size, file) != tfa_manifest_record_size ||
+                fwrite(entry->name, 1, namesize + 1, file) != namesize + 1; // with null terminator
+    }
+    if (fclose(file) != 0 || error) {
+        fprintf(stderr, "virtualtfa_archive_write_manifest: write error\n");
+        return 1;
+    }
+    return 0;
+}
+
+virtualtfa_archive* virtualtfa_archive_new_delta(virtualtfa_archive* this, virtualtfa_manifest* previous) {
+    virtualtfa_archive* delta = virtualtfa_archive_new();
+    char* seen = (char*) calloc(previous->records_size ? previous->records_size : 1, 1);
+    if (!delta || !seen) {
+        fprintf(stderr, "virtualtfa_archive_new_delta: memory allocation failed\n");
+        virtualtfa_archive_free(delta);
+        free(seen);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < this->entries_size; ++i) {
+        virtualtfa_entry* entry = this->entries[i];
+        if (!entry) continue;
+        size_t record = virtualtfa_util_manifest_find(previous, entry->name, strlen(entry->name));
+        if (record != SIZE_MAX) {
+            seen[record] = 1;
+            if (entry->typeflag == VIRTUALTFA_TYPEFLAG_CHUNKED) { // size unknown, always resent
+                virtualtfa_archive_add(delta, entry);
+                continue;
+            }
+            const char* record_ptr = previous->data + previous->records[record];
+            uint64_t record_hash = virtualtfa_util_read_u64(record_ptr + 4 + 8 + 8);
+            if (virtualtfa_util_read_u64(record_ptr + 4) == entry->size &&
+                virtualtfa_util_read_u64(record_ptr + 4 + 8) == entry->mtime &&
+                (record_hash == 0 || entry->hash == 0 || record_hash == entry->hash)) {
+                continue; // unchanged
+            }
+        }
+        virtualtfa_archive_add(delta, entry);
+    }
+
+    // Names absent from the current archive become deletion records
+    for (size_t record = 0; record < previous->records_size; ++record) {
+        tfa_namesize_t namesize;
+        const char* name = virtualtfa_util_manifest_record_name(previous, record, &namesize);
+        if (seen[record] || virtualtfa_util_manifest_find(previous, name, namesize) != record) continue;
+        virtualtfa_entry* entry = virtualtfa_entry_new();
+        if (!entry || virtualtfa_util_archive_add_owned(delta, entry) != 0) {
+            fprintf(stderr, "virtualtfa_archive_new_delta: memory allocation failed\n");
+            free(seen);
+            virtualtfa_archive_free(delta);
+            return NULL;
+        }
+        entry->name = name; // null terminated inside the mapped manifest
+        entry->typeflag = VIRTUALTFA_TYPEFLAG_DELETED;
+    }
+
+    free(seen);
+    return delta;
+}
+
+bool virtualtfa_archive_is_frozen(virtualtfa_archive* this) {
+    return this->frozen;
+}
+
+typedef struct {
+    uint64_t physical;
+    uint64_t inode;
+    size_t index;
+    virtualtfa_entry* entry;
+} virtualtfa_util_layout_key;
+
+int virtualtfa_util_compare_layout_keys(const void* a, const void* b) {
+    const virtualtfa_util_layout_key* left = (const virtualtfa_util_layout_key*) a;
+    const virtualtfa_util_layout_key* right = (const virtualtfa_util_layout_key*) b;
+    if (left->physical != right->physical) {
+        return left->physical < right->physical ? -1 : 1;
+    }
+    if (left->inode != right->inode) {
+        return left->inode < right->inode ? -1 : 1;
+    }
+    // Insertion order breaks ties, which keeps the sort stable
+    return left->index < right->index ? -1 : (left->index > right->index ? 1 : 0);
+}
+
+int virtualtfa_archive_sort_by_layout(virtualtfa_archive* this) {
+    if (this->frozen) {
+        fprintf(stderr, "virtualtfa_archive_sort_by_layout: archive is frozen\n");
+        return 1;
+    }
+    if (this->entries_size < 2) {
+        return 0;
+    }
+    virtualtfa_util_layout_key* keys = (virtualtfa_util_layout_key*) malloc(
+            this->entries_size * sizeof(virtualtfa_util_layout_key));
+    if (!keys) {
+        fprintf(stderr, "virtualtfa_archive_sort_by_layout: memory allocation failed\n");
+        return 1;
+    }
+    for (size_t i = 0; i < this->entries_size; ++i) {
+        virtualtfa_util_layout_key* key = &keys[i];
+        key->physical = UINT64_MAX;
+        key->inode = UINT64_MAX;
+        key->index = i;
+        key->entry = this->entries[i];
+        // Entries without a source path keep their relative order after the located ones
+        if (key->entry && key->entry->path) {
+            virtualtfa_util_get_file_location(key->entry->path, &key->physical, &key->inode);
+        }
+    }
+    qsort(keys, this->entries_size, sizeof(virtualtfa_util_layout_key), virtualtfa_util_compare_layout_keys);
+    for (size_t i = 0; i < this->entries_size; ++i) {
+        this->entries[i] = keys[i].entry;
+    }
+    free(keys);
+    return 0;
+}
+
+// Index of the last entry starting at or before position
+size_t virtualtfa_util_archive_find_position(virtualtfa_archive* this, tfa_size_t position) {
+    size_t low = 0;
+    size_t high = this->entries_size;
+    while (high - low > 1) {
+        size_t middle = low + (high - low) / 2;
+        if (this->positions[middle] <= position) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
 /*
  * Writer
  */
@@ -333,17 +920,21 @@ void virtualtfa_util_set_namesize(tfa_header* header, tfa_namesize_t namesize) {
 }
 
 void virtualtfa_util_set_filesize(tfa_header* header, tfa_size_t filesize) {
-    virtualtfa_util_write_u32(header->filesize, filesize);
+    virtualtfa_util_write_u64(header->filesize, filesize);
 }
 
 tfa_header* virtualtfa_util_convert_entry_to_header(virtualtfa_entry* entry) {
     tfa_header* header = (tfa_header*) malloc(sizeof(tfa_header));
     if (header) {
         virtualtfa_util_set_magic(header);
+        header->version = VIRTUALTFA_VERSION;
+        header->typeflag = (char) entry->typeflag;
+        virtualtfa_util_write_u64(header->reserved, entry->hash);
         virtualtfa_util_set_mode(header, entry->mode);
         virtualtfa_util_set_ctime_mtime(header, entry->ctime, entry->mtime);
         virtualtfa_util_set_namesize(header, (tfa_namesize_t) strlen(entry->name)); // without null terminator
-        virtualtfa_util_set_filesize(header, entry->size);
+        virtualtfa_util_set_filesize(header, entry->typeflag == VIRTUALTFA_TYPEFLAG_CHUNKED ? VIRTUALTFA_SIZE_UNKNOWN
+                                                                                            : entry->size);
     }
     return header;
 }
@@ -360,12 +951,105 @@ virtualtfa_file_info* virtualtfa_util_convert_entry_to_info(virtualtfa_entry* en
     return fileInfo;
 }
 
+int virtualtfa_archive_freeze(virtualtfa_archive* this) {
+    if (this->frozen) {
+        return 0;
+    }
+    tfa_size_t* meta_offsets = (tfa_size_t*) malloc((this->entries_size + 1) * sizeof(tfa_size_t));
+    tfa_size_t* positions = (tfa_size_t*) malloc((this->entries_size + 1) * sizeof(tfa_size_t));
+    if (!meta_offsets || !positions) {
+        fprintf(stderr, "virtualtfa_archive_freeze: memory allocation failed\n");
+        free(meta_offsets);
+        free(positions);
+        return 1;
+    }
+
+    tfa_size_t meta_size = 0;
+    tfa_size_t size = 0;
+    for (size_t i = 0; i < this->entries_size; ++i) {
+        virtualtfa_entry* entry = this->entries[i];
+        meta_offsets[i] = meta_size;
+        positions[i] = size;
+        if (!entry) continue;
+        tfa_size_t entry_meta_size = tfa_header_size + strlen(entry->name);
+        meta_size += entry_meta_size;
+        if (entry->typeflag == VIRTUALTFA_TYPEFLAG_CHUNKED) {
+            size = VIRTUALTFA_SIZE_UNKNOWN;
+        } else if (size != VIRTUALTFA_SIZE_UNKNOWN) {
+            size += entry_meta_size + entry->size;
+        }
+    }
+    meta_offsets[this->entries_size] = meta_size;
+    positions[this->entries_size] = size;
+
+    char* meta = (char*) malloc(meta_size ? meta_size : 1);
+    if (!meta) {
+        fprintf(stderr, "virtualtfa_archive_freeze: memory allocation failed\n");
+        free(meta_offsets);
+        free(positions);
+        return 1;
+    }
+    for (size_t i = 0; i < this->entries_size; ++i) {
+        virtualtfa_entry* entry = this->entries[i];
+        if (!entry) continue;
+        tfa_header* header = virtualtfa_util_convert_entry_to_header(entry);
+        if (!header) {
+            fprintf(stderr, "virtualtfa_archive_freeze: unable to create header\n");
+            free(meta);
+            free(meta_offsets);
+            free(positions);
+            return 1;
+        }
+        memcpy(meta + meta_offsets[i], header, tfa_header_size);
+        memcpy(meta + meta_offsets[i] + tfa_header_size, entry->name,
+               meta_offsets[i + 1] - meta_offsets[i] - tfa_header_size);
+        free(header);
+    }
+
+    if (size == VIRTUALTFA_SIZE_UNKNOWN) { // positions after a chunked entry are only known while writing
+        free(positions);
+        positions = NULL;
+    }
+    this->meta = meta;
+    this->meta_offsets = meta_offsets;
+    this->positions = positions;
+    this->size = size;
+    this->frozen = true;
+    return 0;
+}
+
+// Prefetched file data handed out by virtualtfa_writer_next_iovecs
+typedef struct {
+    virtualtfa_entry* entry;
+    tfa_size_t position; // archive position
+    tfa_size_t data_offset; // offset into the entry data
+    tfa_size_t offset; // offset into the prefetch buffer
+    tfa_size_t size;
+} virtualtfa_util_iov_segment;
+
 struct _virtualtfa_writer {
     virtualtfa_archive* archive;
     virtualtfa_listener* listener;
     tfa_size_t pointer;
+    tfa_size_t end; // exclusive end of the written range
     tfa_header* current_header;
     virtualtfa_input_stream* current_stream;
+
+    // Chunked entries, see README.md
+    tfa_size_t* chunked_sizes; // framed size of finished chunked entries by index, VIRTUALTFA_SIZE_UNKNOWN until then
+    tfa_size_t chunk_entry_written; // framed bytes of the current chunked entry
+    tfa_size_t chunk_data_written; // payload bytes of the current chunked entry
+    char* chunk_stage; // chunk staged when its length prefix does not fit in the buffer
+    tfa_size_t chunk_stage_pos;
+    tfa_size_t chunk_stage_size;
+
+    // Scatter-gather
+    tfa_size_t stream_position; // archive position the current stream reads next, VIRTUALTFA_SIZE_UNKNOWN if unknown
+    char* iov_buffer;
+    tfa_size_t iov_buffer_used;
+    virtualtfa_util_iov_segment* iov_segments; // not yet advanced past, in archive order
+    size_t iov_segments_size;
+    size_t iov_segments_capacity;
 };
 
 virtualtfa_writer* virtualtfa_writer_new() {
@@ -374,14 +1058,39 @@ virtualtfa_writer* virtualtfa_writer_new() {
         this->archive = NULL;
         this->listener = NULL;
         this->pointer = 0;
+        this->end = UINT64_MAX;
         this->current_header = NULL;
         this->current_stream = NULL;
+        this->chunked_sizes = NULL;
+        this->chunk_entry_written = 0;
+        this->chunk_data_written = 0;
+        this->chunk_stage = NULL;
+        this->chunk_stage_pos = 0;
+        this->chunk_stage_size = 0;
+        this->stream_position = VIRTUALTFA_SIZE_UNKNOWN;
+        this->iov_buffer = NULL;
+        this->iov_buffer_used = 0;
+        this->iov_segments = NULL;
+        this->iov_segments_size = 0;
+        this->iov_segments_capacity = 0;
     }
     return this;
 }
 
 void virtualtfa_writer_free(virtualtfa_writer* this) {
     if (this) {
+        // a range may end in the middle of an entry
+        if (this->current_header) {
+            free(this->current_header);
+        }
+        if (this->current_stream) {
+            virtualtfa_input_stream_close(this->current_stream);
+            virtualtfa_input_stream_free(this->current_stream);
+        }
+        free(this->chunked_sizes);
+        free(this->chunk_stage);
+        free(this->iov_buffer);
+        free(this->iov_segments);
         free(this);
     }
 }
@@ -402,20 +1111,162 @@ void virtualtfa_writer_set_listener(virtualtfa_writer* this, virtualtfa_listener
     this->listener = listener;
 }
 
+tfa_size_t virtualtfa_writer_get_position(virtualtfa_writer* this) {
+    return this->pointer;
+}
+
+void virtualtfa_writer_set_range(virtualtfa_writer* this, tfa_size_t start, tfa_size_t end) {
+    this->pointer = start;
+    this->end = end;
+}
+
 tfa_size_t virtualtfa_writer_calc_size(virtualtfa_writer* this) {
+    if (this->archive->frozen) {
+        return this->archive->size;
+    }
     tfa_size_t size = 0;
-    for (int i = 0; i < this->archive->entries_size; ++i) {
+    for (size_t i = 0; i < this->archive->entries_size; ++i) {
         virtualtfa_entry* entry = this->archive->entries[i];
         if (!entry) continue;
-        size += tfa_header_size + strlen(entry->name) + 1 + entry->size; // name will have \0 at end
+        if (entry->typeflag == VIRTUALTFA_TYPEFLAG_CHUNKED) {
+            return VIRTUALTFA_SIZE_UNKNOWN;
+        }
+        size += tfa_header_size + strlen(entry->name) + entry->size; // name is written without null terminator
     }
     return size;
 }
 
+#define VIRTUALTFA_CHUNK_STAGE_SIZE 4096
+
+void virtualtfa_util_writer_chunk_progress(virtualtfa_writer* this, virtualtfa_entry* entry, bool end) {
+    if (!this->listener) return;
+    virtualtfa_file_info* fileInfo = virtualtfa_util_convert_entry_to_info(entry);
+    if (fileInfo) {
+        fileInfo->size = end ? this->chunk_data_written : VIRTUALTFA_SIZE_UNKNOWN;
+        this->listener->file_progress(this->listener->file_progress_userdata, fileInfo, this->chunk_data_written);
+        if (end) {
+            this->listener->file_end(this->listener->file_end_userdata, fileInfo);
+        }
+        free(fileInfo);
+    }
+}
+
+// Pull the input stream of a chunked entry until EOF, framing it as length-prefixed chunks
+int virtualtfa_util_writer_write_chunked(virtualtfa_writer* this,
+                                         virtualtfa_entry* entry,
+                                         size_t index,
+                                         char* buffer,
+                                         tfa_size_t* bytes_written,
+                                         tfa_size_t* buffer_size_left) {
+    if (!this->current_stream) {
+        if (this->chunk_entry_written > 0) {
+            fprintf(stderr, "virtualtfa_writer_write: unable to resume a chunked entry\n");
+            return 1;
+        }
+        this->current_stream = entry->stream_supplier(entry->stream_supplier_userdata);
+        if (!this->current_stream) {
+            fprintf(stderr, "virtualtfa_writer_write: unable to create input stream\n");
+            return 1;
+        }
+        this->chunk_data_written = 0;
+        if (this->listener) {
+            virtualtfa_file_info* fileInfo = virtualtfa_util_convert_entry_to_info(entry);
+            if (fileInfo) {
+                fileInfo->size = VIRTUALTFA_SIZE_UNKNOWN;
+                this->listener->file_start(this->listener->file_start_userdata, fileInfo);
+                free(fileInfo);
+            }
+        }
+    }
+
+    bool end = false;
+    while (*buffer_size_left > 0 && !end) {
+        tfa_size_t to_write;
+        if (this->chunk_stage_pos < this->chunk_stage_size) {
+            to_write = MIN(this->chunk_stage_size - this->chunk_stage_pos, *buffer_size_left);
+            memcpy(buffer + *bytes_written, this->chunk_stage + this->chunk_stage_pos, to_write);
+            this->chunk_stage_pos += to_write;
+            end = this->chunk_stage_size == 4 && this->chunk_stage_pos == 4; // terminator fully written
+        } else {
+            tfa_size_t chunk_size;
+            if (*buffer_size_left > 4) {
+                // read straight into the buffer behind the length prefix
+                tfa_size_t max_chunk_size = MIN(*buffer_size_left - 4, UINT32_MAX);
+                if (virtualtfa_input_stream_read(this->current_stream, buffer + *bytes_written + 4, max_chunk_size,
+                                                 &chunk_size) != 0) {
+                    fprintf(stderr, "virtualtfa_writer_write: read error\n");
+                    return 1;
+                }
+                virtualtfa_util_write_u32(buffer + *bytes_written, (uint32_t) chunk_size);
+                to_write = 4 + chunk_size;
+            } else {
+                if (!this->chunk_stage) {
+                    this->chunk_stage = (char*) malloc(4 + VIRTUALTFA_CHUNK_STAGE_SIZE);
+                    if (!this->chunk_stage) {
+                        fprintf(stderr, "virtualtfa_writer_write: memory allocation failed\n");
+                        return 1;
+                    }
+                }
+                if (virtualtfa_input_stream_read(this->current_stream, this->chunk_stage + 4,
+                                                 VIRTUALTFA_CHUNK_STAGE_SIZE, &chunk_size) != 0) {
+                    fprintf(stderr, "virtualtfa_writer_write: read error\n");
+                    return 1;
+                }
+                virtualtfa_util_write_u32(this->chunk_stage, (uint32_t) chunk_size);
+                this->chunk_stage_size = 4 + chunk_size;
+                to_write = MIN(this->chunk_stage_size, *buffer_size_left);
+                memcpy(buffer + *bytes_written, this->chunk_stage, to_write);
+                this->chunk_stage_pos = to_write;
+            }
+            this->chunk_data_written += chunk_size;
+            end = chunk_size == 0 && this->chunk_stage_pos == this->chunk_stage_size;
+        }
+        *buffer_size_left -= to_write;
+        *bytes_written += to_write;
+        this->pointer += to_write;
+        this->chunk_entry_written += to_write;
+    }
+
+    virtualtfa_util_writer_chunk_progress(this, entry, end);
+    if (end) {
+        this->chunked_sizes[index] = this->chunk_entry_written;
+        this->chunk_entry_written = 0;
+        this->chunk_stage_pos = this->chunk_stage_size = 0;
+        virtualtfa_input_stream_close(this->current_stream);
+        virtualtfa_input_stream_free(this->current_stream);
+        this->current_stream = NULL;
+    }
+    return 0;
+}
+
 int virtualtfa_writer_write(virtualtfa_writer* this,
                              char* buffer,
                              tfa_size_t buffer_size,
                              tfa_size_t* out_bytes_written) {
+    if (this->pointer >= this->end) {
+        if (out_bytes_written) {
+            *out_bytes_written = 0;
+        }
+        return 0;
+    }
+    buffer_size = MIN(buffer_size, this->end - this->pointer);
+
+    if (!this->chunked_sizes) {
+        for (size_t i = 0; i < this->archive->entries_size; ++i) {
+            if (this->archive->entries[i] && this->archive->entries[i]->typeflag == VIRTUALTFA_TYPEFLAG_CHUNKED) {
+                this->chunked_sizes = (tfa_size_t*) malloc(this->archive->entries_size * sizeof(tfa_size_t));
+                if (!this->chunked_sizes) {
+                    fprintf(stderr, "virtualtfa_writer_write: memory allocation failed\n");
+                    return 1;
+                }
+                for (size_t j = 0; j < this->archive->entries_size; ++j) {
+                    this->chunked_sizes[j] = VIRTUALTFA_SIZE_UNKNOWN;
+                }
+                break;
+            }
+        }
+    }
+
     tfa_size_t bytes_written = 0;
     tfa_size_t buffer_size_left = buffer_size;
     tfa_size_t absolute_part_start_pos = 0; // absolute part start position
@@ -423,57 +1274,96 @@ int virtualtfa_writer_write(virtualtfa_writer* this,
     tfa_size_t total_part_bytes_written;
     tfa_size_t part_bytes_to_write;
 
-    for (int i = 0; i < this->archive->entries_size; ++i) {
+    size_t first = 0;
+    if (this->archive->positions) { // frozen, start at the entry containing the pointer
+        first = virtualtfa_util_archive_find_position(this->archive, this->pointer);
+        absolute_part_start_pos = this->archive->positions[first];
+    }
+
+    for (size_t i = first; i < this->archive->entries_size; ++i) {
         virtualtfa_entry* entry = this->archive->entries[i];
         if (!entry) continue;
 
-        // Header
-        current_part_size = tfa_header_size;
-        if (virtualtfa_util_calc_part_write(buffer_size_left,
-                                             this->pointer,
-                                             absolute_part_start_pos,
-                                             current_part_size,
-                                             &total_part_bytes_written,
-                                             &part_bytes_to_write)) {
-            if (!this->current_header) {
-                this->current_header = virtualtfa_util_convert_entry_to_header(entry);
+        if (this->archive->frozen) {
+            // Header and Name, pre-serialized
+            current_part_size = this->archive->meta_offsets[i + 1] - this->archive->meta_offsets[i];
+            if (virtualtfa_util_calc_part_write(buffer_size_left,
+                                                 this->pointer,
+                                                 absolute_part_start_pos,
+                                                 current_part_size,
+                                                 &total_part_bytes_written,
+                                                 &part_bytes_to_write)) {
+                const char* metaBufferPtr = this->archive->meta + this->archive->meta_offsets[i] +
+                                            total_part_bytes_written; // offset
+                memcpy(buffer + bytes_written, metaBufferPtr, part_bytes_to_write);
+                buffer_size_left -= part_bytes_to_write;
+                bytes_written += part_bytes_to_write;
+                this->pointer += part_bytes_to_write;
+                if (bytes_written == buffer_size) break;
+            }
+            absolute_part_start_pos += current_part_size;
+        } else {
+            // Header
+            current_part_size = tfa_header_size;
+            if (virtualtfa_util_calc_part_write(buffer_size_left,
+                                                 this->pointer,
+                                                 absolute_part_start_pos,
+                                                 current_part_size,
+                                                 &total_part_bytes_written,
+                                                 &part_bytes_to_write)) {
                 if (!this->current_header) {
-                    fprintf(stderr, "virtualtfa_writer_write: unable to create header\n");
-                    return 1;
+                    this->current_header = virtualtfa_util_convert_entry_to_header(entry);
+                    if (!this->current_header) {
+                        fprintf(stderr, "virtualtfa_writer_write: unable to create header\n");
+                        return 1;
+                    }
                 }
+                char* headerBufferPtr = (char*) (this->current_header) + total_part_bytes_written; // offset
+                memcpy(buffer + bytes_written, headerBufferPtr, part_bytes_to_write);
+                buffer_size_left -= part_bytes_to_write;
+                bytes_written += part_bytes_to_write;
+                this->pointer += part_bytes_to_write;
+                if (total_part_bytes_written + part_bytes_to_write == current_part_size) {
+                    free(this->current_header);
+                    this->current_header = NULL;
+                }
+                if (bytes_written == buffer_size) break;
             }
-            char* headerBufferPtr = (char*) (this->current_header) + total_part_bytes_written; // offset
-            memcpy(buffer + bytes_written, headerBufferPtr, part_bytes_to_write);
-            buffer_size_left -= part_bytes_to_write;
-            bytes_written += part_bytes_to_write;
-            this->pointer += part_bytes_to_write;
-            if (total_part_bytes_written + part_bytes_to_write == current_part_size) {
-                free(this->current_header);
-                this->current_header = NULL;
+            absolute_part_start_pos += current_part_size;
+
+            // Name
+            current_part_size = strlen(entry->name); // without null terminator
+            if (virtualtfa_util_calc_part_write(buffer_size_left,
+                                                 this->pointer,
+                                                 absolute_part_start_pos,
+                                                 current_part_size,
+                                                 &total_part_bytes_written,
+                                                 &part_bytes_to_write)) {
+                const char* nameBufferPtr = entry->name + total_part_bytes_written; // offset
+                memcpy(buffer + bytes_written, nameBufferPtr, part_bytes_to_write);
+                buffer_size_left -= part_bytes_to_write;
+                bytes_written += part_bytes_to_write;
+                this->pointer += part_bytes_to_write;
+                if (bytes_written == buffer_size) break;
             }
-            if (bytes_written == buffer_size) break;
+            absolute_part_start_pos += current_part_size;
         }
-        absolute_part_start_pos += current_part_size;
 
-        // Name
-        current_part_size = strlen(entry->name); // without null terminator
-        if (virtualtfa_util_calc_part_write(buffer_size_left,
-                                             this->pointer,
-                                             absolute_part_start_pos,
-                                             current_part_size,
-                                             &total_part_bytes_written,
-                                             &part_bytes_to_write)) {
-            const char* nameBufferPtr = entry->name + total_part_bytes_written; // offset
-            memcpy(buffer + bytes_written, nameBufferPtr, part_bytes_to_write);
-            buffer_size_left -= part_bytes_to_write;
-            bytes_written += part_bytes_to_write;
-            this->pointer += part_bytes_to_write;
+        // File Data
+        if (entry->typeflag == VIRTUALTFA_TYPEFLAG_CHUNKED && this->chunked_sizes[i] == VIRTUALTFA_SIZE_UNKNOWN) {
+            if (this->pointer != absolute_part_start_pos + this->chunk_entry_written) {
+                fprintf(stderr, "virtualtfa_writer_write: unable to seek past a chunked entry\n");
+                return 1;
+            }
+            if (virtualtfa_util_writer_write_chunked(this, entry, i, buffer, &bytes_written, &buffer_size_left) != 0) {
+                return 1;
+            }
+            if (this->chunked_sizes[i] == VIRTUALTFA_SIZE_UNKNOWN) break; // buffer is full
+            absolute_part_start_pos += this->chunked_sizes[i];
             if (bytes_written == buffer_size) break;
+            continue;
         }
-        absolute_part_start_pos += current_part_size;
-
-        // File Data
-        current_part_size = entry->size;
+        current_part_size = entry->typeflag == VIRTUALTFA_TYPEFLAG_CHUNKED ? this->chunked_sizes[i] : entry->size;
         if (virtualtfa_util_calc_part_write(buffer_size_left,
                                              this->pointer,
                                              absolute_part_start_pos,
@@ -486,6 +1376,11 @@ int virtualtfa_writer_write(virtualtfa_writer* this,
                     fprintf(stderr, "virtualtfa_writer_write: unable to create input stream\n");
                     return 1;
                 }
+                if (total_part_bytes_written > 0 && // range starts in the middle of the file data
+                    virtualtfa_input_stream_seek(this->current_stream, total_part_bytes_written) != 0) {
+                    fprintf(stderr, "virtualtfa_writer_write: seek error\n");
+                    return 1;
+                }
             }
             if (this->listener && total_part_bytes_written == 0) {
                 virtualtfa_file_info* fileInfo = virtualtfa_util_convert_entry_to_info(entry);
@@ -494,9 +1389,8 @@ int virtualtfa_writer_write(virtualtfa_writer* this,
                     free(fileInfo);
                 }
             }
-            //fseek(entry->file, partWrittenBytes, SEEK_SET); // currently removed: current_stream->seek
-            int read_result = virtualtfa_input_stream_read(this->current_stream, buffer + bytes_written,
-                                                            part_bytes_to_write, NULL);
+            int read_result = virtualtfa_util_input_stream_read_full(this->current_stream, buffer + bytes_written,
+                                                                      part_bytes_to_write);
             if (read_result != 0) {
                 fprintf(stderr, "virtualtfa_writer_write: read error\n");
                 return 1;
@@ -536,6 +1430,200 @@ int virtualtfa_writer_write(virtualtfa_writer* this,
     return 0;
 }
 
+#if !defined(_WIN32)
+
+#define VIRTUALTFA_IOVEC_BUFFER_SIZE (1024 * 1024)
+
+// Read size bytes of file data at archive position into the prefetch buffer
+int virtualtfa_util_writer_prefetch(virtualtfa_writer* this,
+                                    virtualtfa_entry* entry,
+                                    tfa_size_t position,
+                                    tfa_size_t data_offset,
+                                    tfa_size_t size) {
+    if (this->iov_segments_size == this->iov_segments_capacity) {
+        size_t capacity = this->iov_segments_capacity ? this->iov_segments_capacity * 2 : 16;
+        virtualtfa_util_iov_segment* segments = (virtualtfa_util_iov_segment*) realloc(
+                this->iov_segments, capacity * sizeof(virtualtfa_util_iov_segment));
+        if (!segments) {
+            fprintf(stderr, "virtualtfa_writer_next_iovecs: memory allocation failed\n");
+            return 1;
+        }
+        this->iov_segments = segments;
+        this->iov_segments_capacity = capacity;
+    }
+
+    if (this->current_stream && this->stream_position != position) {
+        virtualtfa_input_stream_close(this->current_stream);
+        virtualtfa_input_stream_free(this->current_stream);
+        this->current_stream = NULL;
+    }
+    if (!this->current_stream) {
+        this->current_stream = entry->stream_supplier(entry->stream_supplier_userdata);
+        if (!this->current_stream) {
+            fprintf(stderr, "virtualtfa_writer_next_iovecs: unable to create input stream\n");
+            return 1;
+        }
+        if (data_offset > 0 && virtualtfa_input_stream_seek(this->current_stream, data_offset) != 0) {
+            fprintf(stderr, "virtualtfa_writer_next_iovecs: seek error\n");
+            return 1;
+        }
+        this->stream_position = position;
+        if (this->listener && data_offset == 0) {
+            virtualtfa_file_info* fileInfo = virtualtfa_util_convert_entry_to_info(entry);
+            if (fileInfo) {
+                this->listener->file_start(this->listener->file_start_userdata, fileInfo);
+                free(fileInfo);
+            }
+        }
+    }
+
+    if (virtualtfa_util_input_stream_read_full(this->current_stream, this->iov_buffer + this->iov_buffer_used, size) != 0) {
+        fprintf(stderr, "virtualtfa_writer_next_iovecs: read error\n");
+        return 1;
+    }
+    virtualtfa_util_iov_segment* segment = &this->iov_segments[this->iov_segments_size++];
+    segment->entry = entry;
+    segment->position = position;
+    segment->data_offset = data_offset;
+    segment->offset = this->iov_buffer_used;
+    segment->size = size;
+    this->iov_buffer_used += size;
+    this->stream_position += size;
+
+    // progress and file_end follow virtualtfa_writer_advance, the data is not sent yet
+    if (data_offset + size == entry->size) {
+        virtualtfa_input_stream_close(this->current_stream);
+        virtualtfa_input_stream_free(this->current_stream);
+        this->current_stream = NULL;
+        this->stream_position = VIRTUALTFA_SIZE_UNKNOWN;
+    }
+    return 0;
+}
+
+int virtualtfa_writer_next_iovecs(virtualtfa_writer* this,
+                                  struct iovec* out,
+                                  int max,
+                                  size_t max_bytes,
+                                  int* out_count) {
+    *out_count = 0;
+    virtualtfa_archive* archive = this->archive;
+    if (!archive->frozen || !archive->positions) {
+        fprintf(stderr, "virtualtfa_writer_next_iovecs: archive must be frozen and without chunked entries\n");
+        return 1;
+    }
+    if (!this->iov_buffer) {
+        this->iov_buffer = (char*) malloc(VIRTUALTFA_IOVEC_BUFFER_SIZE);
+        if (!this->iov_buffer) {
+            fprintf(stderr, "virtualtfa_writer_next_iovecs: memory allocation failed\n");
+            return 1;
+        }
+    }
+
+    // Drop prefetched data that was advanced past and move the rest to the front of the buffer
+    size_t dropped = 0;
+    while (dropped < this->iov_segments_size &&
+           this->iov_segments[dropped].position + this->iov_segments[dropped].size <= this->pointer) {
+        dropped++;
+    }
+    this->iov_segments_size -= dropped;
+    memmove(this->iov_segments, this->iov_segments + dropped,
+            this->iov_segments_size * sizeof(virtualtfa_util_iov_segment));
+    if (this->iov_segments_size > 0) {
+        virtualtfa_util_iov_segment* first = &this->iov_segments[0];
+        if (first->position < this->pointer) { // partially advanced
+            tfa_size_t advanced = this->pointer - first->position;
+            first->position += advanced;
+            first->data_offset += advanced;
+            first->offset += advanced;
+            first->size -= advanced;
+        }
+        tfa_size_t shift = first->offset;
+        memmove(this->iov_buffer, this->iov_buffer + shift, this->iov_buffer_used - shift);
+        this->iov_buffer_used -= shift;
+        for (size_t i = 0; i < this->iov_segments_size; ++i) {
+            this->iov_segments[i].offset -= shift;
+        }
+    } else {
+        this->iov_buffer_used = 0;
+    }
+
+    tfa_size_t limit = MIN(this->end, archive->size);
+    tfa_size_t position = this->pointer;
+    size_t bytes = 0;
+    int count = 0;
+    size_t segment = 0; // next retained segment
+    size_t i = position < limit ? virtualtfa_util_archive_find_position(archive, position) : archive->entries_size;
+    while (count < max && bytes < max_bytes && position < limit) {
+        virtualtfa_entry* entry = archive->entries[i];
+        tfa_size_t entry_start = archive->positions[i];
+        tfa_size_t data_start = entry_start + archive->meta_offsets[i + 1] - archive->meta_offsets[i];
+        tfa_size_t entry_end = archive->positions[i + 1];
+        if (!entry || position >= entry_end) {
+            i++;
+            continue;
+        }
+
+        tfa_size_t to_send = MIN(MIN(entry_end, limit) - position, max_bytes - bytes);
+        if (position < data_start) { // header and name, pre-serialized
+            to_send = MIN(to_send, data_start - position);
+            out[count].iov_base = archive->meta + archive->meta_offsets[i] + (position - entry_start);
+        } else if (segment < this->iov_segments_size) { // prefetched by an earlier call
+            virtualtfa_util_iov_segment* retained = &this->iov_segments[segment++];
+            if (retained->position != position) {
+                fprintf(stderr, "virtualtfa_writer_next_iovecs: prefetched data out of order\n");
+                return 1;
+            }
+            to_send = MIN(to_send, retained->size);
+            out[count].iov_base = this->iov_buffer + retained->offset;
+        } else {
+            to_send = MIN(to_send, VIRTUALTFA_IOVEC_BUFFER_SIZE - this->iov_buffer_used);
+            if (to_send == 0) break; // prefetch buffer is full
+            if (virtualtfa_util_writer_prefetch(this, entry, position, position - data_start, to_send) != 0) {
+                return 1;
+            }
+            out[count].iov_base = this->iov_buffer + this->iov_segments[segment++].offset;
+        }
+        out[count].iov_len = to_send;
+        count++;
+        bytes += to_send;
+        position += to_send;
+    }
+
+    *out_count = count;
+    return 0;
+}
+
+int virtualtfa_writer_advance(virtualtfa_writer* this, tfa_size_t bytes) {
+    if (bytes > MIN(this->end, this->archive->size) - this->pointer) {
+        fprintf(stderr, "virtualtfa_writer_advance: advancing past the end\n");
+        return 1;
+    }
+    tfa_size_t previous = this->pointer;
+    this->pointer += bytes;
+    // Report file data sent by this advance, segments ending before previous were reported earlier
+    for (size_t i = 0; this->listener && i < this->iov_segments_size; ++i) {
+        virtualtfa_util_iov_segment* segment = &this->iov_segments[i];
+        if (segment->position + segment->size <= previous) continue;
+        if (segment->position >= this->pointer) break;
+        tfa_size_t sent = MIN(segment->position + segment->size, this->pointer) - segment->position;
+        virtualtfa_file_info* fileInfo = virtualtfa_util_convert_entry_to_info(segment->entry);
+        if (fileInfo) {
+            this->listener->file_progress(this->listener->file_progress_userdata, fileInfo,
+                                          segment->data_offset + sent);
+            if (segment->data_offset + sent == segment->entry->size) {
+                this->listener->file_end(this->listener->file_end_userdata, fileInfo);
+            }
+            free(fileInfo);
+        }
+    }
+    if (this->listener) {
+        this->listener->total_progress(this->listener->total_progress_userdata, this->pointer);
+    }
+    return 0;
+}
+
+#endif
+
 /*
  * Reader
  */
@@ -553,27 +1641,38 @@ virtualtfa_file_info virtualtfa_util_file_info_constructor(const char* name,
     return fileinfo;
 }
 
-const char* virtualtfa_util_delimiter = "/";
-
 bool virtualtfa_util_is_path_valid(const char* path) {
-    char* str = strdup(path);
-    char* token = strtok(str, virtualtfa_util_delimiter);
-
-    while (token != NULL) {
-        if (strcmp(token, ".") == 0 || strcmp(token, "..") == 0) {
-            free(str);
+    const char* token = path;
+    while (*token) {
+        const char* token_end = strchr(token, '/');
+        size_t token_size = token_end ? (size_t) (token_end - token) : strlen(token);
+        if ((token_size == 1 && token[0] == '.') || (token_size == 2 && token[0] == '.' && token[1] == '.')) {
             return false;
         }
-        token = strtok(NULL, virtualtfa_util_delimiter);
+        if (!token_end) break;
+        token = token_end + 1;
     }
-
-    free(str);
     return true;
 }
 
+// Received archive byte range [start, end)
+typedef struct _virtualtfa_range {
+    tfa_size_t start;
+    tfa_size_t end;
+} virtualtfa_range;
+
 struct _virtualtfa_reader {
     const char* dest;
     virtualtfa_listener* listener;
+    FILE* spool;
+    bool skip_unchanged;
+    virtualtfa_hash_function hash_function;
+    void* hash_userdata;
+    virtualtfa_file_skipped_function skipped_function;
+    void* skipped_userdata;
+
+    virtualtfa_range* _spooled; // sorted, non-overlapping ranges ahead of _total_read
+    size_t _spooled_size;
 
     char* _cur_header_buf;
     tfa_mode_t _cur_h_mode;
@@ -581,12 +1680,27 @@ struct _virtualtfa_reader {
     tfa_utime_t _cur_h_mtime;
     tfa_namesize_t _cur_h_namesize;
     tfa_size_t _cur_h_filesize;
-    char* _cur_name;
+    tfa_typeflag_t _cur_h_typeflag;
+    uint64_t _cur_h_hash;
+    char* _cur_name; // reused between entries
+    size_t _cur_name_capacity;
     FILE* _cur_ofs;
+    bool _cur_skip; // destination is unchanged, the data is consumed without writing
     tfa_size_t _cur_remain_header_size;
     tfa_namesize_t _cur_remain_name_size;
     tfa_size_t _cur_remain_file_size;
+    char _cur_chunk_prefix_buf[4];
+    tfa_size_t _cur_remain_chunk_prefix_size; // 0 outside chunked entries
+    uint32_t _cur_remain_chunk_size;
+    tfa_size_t _cur_chunk_data_size; // payload written so far
+    char* _cur_sparse_map;
+    tfa_size_t _cur_sparse_map_capacity;
+    tfa_size_t _cur_sparse_map_read;
+    uint32_t _cur_sparse_extent;
+    tfa_size_t _cur_sparse_extent_pos;
     tfa_size_t _total_read;
+    bool _failed; // the stream is corrupt or a file could not be written, set until restore
+    int _pipe[2]; // virtualtfa_reader_read_from_fd, -1 until first used
 };
 
 virtualtfa_reader* virtualtfa_reader_new() {
@@ -594,25 +1708,60 @@ virtualtfa_reader* virtualtfa_reader_new() {
     if (this) {
         this->dest = NULL;
         this->listener = NULL;
+        this->spool = NULL;
+        this->skip_unchanged = false;
+        this->hash_function = NULL;
+        this->hash_userdata = NULL;
+        this->skipped_function = NULL;
+        this->skipped_userdata = NULL;
+        this->_spooled = NULL;
+        this->_spooled_size = 0;
         this->_cur_header_buf = (char*) malloc(tfa_header_size);
         this->_cur_h_mode = 0;
         this->_cur_h_ctime = 0;
         this->_cur_h_mtime = 0;
         this->_cur_h_namesize = 0;
         this->_cur_h_filesize = 0;
+        this->_cur_h_typeflag = VIRTUALTFA_TYPEFLAG_FILE;
+        this->_cur_h_hash = 0;
         this->_cur_name = NULL;
+        this->_cur_name_capacity = 0;
         this->_cur_ofs = NULL;
+        this->_cur_skip = false;
         this->_cur_remain_header_size = tfa_header_size;
         this->_cur_remain_name_size = 0;
         this->_cur_remain_file_size = 0;
-        this->_cur_remain_file_size = 0;
+        this->_cur_remain_chunk_prefix_size = 0;
+        this->_cur_remain_chunk_size = 0;
+        this->_cur_chunk_data_size = 0;
+        this->_cur_sparse_map = NULL;
+        this->_cur_sparse_map_capacity = 0;
+        this->_cur_sparse_map_read = 0;
+        this->_cur_sparse_extent = 0;
+        this->_cur_sparse_extent_pos = 0;
         this->_total_read = 0;
+        this->_failed = false;
+        this->_pipe[0] = -1;
+        this->_pipe[1] = -1;
     }
     return this;
 }
 
 void virtualtfa_reader_free(virtualtfa_reader* this) {
     if (this) {
+        if (this->_cur_ofs) {
+            fclose(this->_cur_ofs);
+        }
+        free(this->_cur_header_buf);
+        free(this->_cur_name);
+        free(this->_cur_sparse_map);
+        free(this->_spooled);
+#if defined(__linux__)
+        if (this->_pipe[0] >= 0) {
+            close(this->_pipe[0]);
+            close(this->_pipe[1]);
+        }
+#endif
         free(this);
     }
 }
@@ -633,13 +1782,262 @@ void virtualtfa_reader_set_listener(virtualtfa_reader* this, virtualtfa_listener
     this->listener = listener;
 }
 
+tfa_size_t virtualtfa_reader_get_total_read(virtualtfa_reader* this) {
+    return this->_total_read;
+}
+
+FILE* virtualtfa_reader_get_spool(virtualtfa_reader* this) {
+    return this->spool;
+}
+
+void virtualtfa_reader_set_spool(virtualtfa_reader* this, FILE* spool) {
+    this->spool = spool;
+}
+
+bool virtualtfa_reader_get_skip_unchanged(virtualtfa_reader* this) {
+    return this->skip_unchanged;
+}
+
+void virtualtfa_reader_set_skip_unchanged(virtualtfa_reader* this, bool skip_unchanged) {
+    this->skip_unchanged = skip_unchanged;
+}
+
+virtualtfa_hash_function virtualtfa_reader_get_hash_function(virtualtfa_reader* this) {
+    return this->hash_function;
+}
+
+void virtualtfa_reader_set_hash_function(virtualtfa_reader* this, virtualtfa_hash_function function) {
+    this->hash_function = function;
+}
+
+void* virtualtfa_reader_get_hash_userdata(virtualtfa_reader* this) {
+    return this->hash_userdata;
+}
+
+void virtualtfa_reader_set_hash_userdata(virtualtfa_reader* this, void* userdata) {
+    this->hash_userdata = userdata;
+}
+
+virtualtfa_file_skipped_function virtualtfa_reader_get_skipped_function(virtualtfa_reader* this) {
+    return this->skipped_function;
+}
+
+void virtualtfa_reader_set_skipped_function(virtualtfa_reader* this, virtualtfa_file_skipped_function function) {
+    this->skipped_function = function;
+}
+
+void* virtualtfa_reader_get_skipped_userdata(virtualtfa_reader* this) {
+    return this->skipped_userdata;
+}
+
+void virtualtfa_reader_set_skipped_userdata(virtualtfa_reader* this, void* userdata) {
+    this->skipped_userdata = userdata;
+}
+
+// Whether the destination of the current plain file already has its size, mtime and hash
+bool virtualtfa_util_reader_is_unchanged(virtualtfa_reader* this, const char* filepath) {
+    tfa_size_t size;
+    tfa_utime_t ctime;
+    tfa_utime_t mtime;
+    tfa_mode_t mode;
+    if (virtualtfa_util_stat_file(filepath, &size, &ctime, &mtime, &mode) != 0) {
+        return false;
+    }
+    if (size != this->_cur_h_filesize || mtime != this->_cur_h_mtime) {
+        return false;
+    }
+    if (this->hash_function && this->_cur_h_hash != 0) {
+        uint64_t hash;
+        if (this->hash_function(this->hash_userdata, filepath, &hash) != 0 || hash != this->_cur_h_hash) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int virtualtfa_util_reader_reserve_name(virtualtfa_reader* this, tfa_namesize_t namesize) {
+    if (this->_cur_name && this->_cur_name_capacity > namesize) {
+        return 0;
+    }
+    char* name = (char*) realloc(this->_cur_name, (size_t) namesize + 1);
+    if (!name) {
+        fprintf(stderr, "virtualtfa_reader_read: memory allocation failed\n");
+        return 1;
+    }
+    this->_cur_name = name;
+    this->_cur_name_capacity = namesize + 1;
+    return 0;
+}
+
+int virtualtfa_util_reader_decode_header(virtualtfa_reader* this, const char* buffer) {
+    const tfa_header* header = (const tfa_header*) buffer; // only char fields, no alignment requirement
+
+    if (memcmp(header->magic, virtualtfa_magic, sizeof(virtualtfa_magic)) != 0) {
+        fprintf(stderr, "virtualtfa_reader_read: invalid magic\n");
+        return 1;
+    }
+    if (header->version != VIRTUALTFA_VERSION) {
+        fprintf(stderr, "virtualtfa_reader_read: unsupported version %d\n", header->version);
+        return 1;
+    }
+    if (virtualtfa_util_read_u32(header->namesize) == 0) { // the name phase would never end
+        fprintf(stderr, "virtualtfa_reader_read: empty file name\n");
+        return 1;
+    }
+    if (header->typeflag == VIRTUALTFA_TYPEFLAG_SPARSE &&
+        virtualtfa_util_read_u64(header->filesize) < tfa_sparse_map_header_size) { // no room for the map
+        fprintf(stderr, "virtualtfa_reader_read: invalid sparse map\n");
+        return 1;
+    }
+
+    this->_cur_h_typeflag = (tfa_typeflag_t) header->typeflag;
+    this->_cur_h_hash = virtualtfa_util_read_u64(header->reserved);
+    this->_cur_h_mode = virtualtfa_util_read_i32(header->mode);
+    this->_cur_h_ctime = virtualtfa_util_read_u64(header->ctime);
+    this->_cur_h_mtime = virtualtfa_util_read_u64(header->mtime);
+    this->_cur_remain_name_size = this->_cur_h_namesize = virtualtfa_util_read_u32(header->namesize);
+    this->_cur_remain_file_size = this->_cur_h_filesize = virtualtfa_util_read_u64(header->filesize);
+    this->_cur_remain_header_size = 0;
+    if (this->_cur_h_typeflag == VIRTUALTFA_TYPEFLAG_CHUNKED) {
+        this->_cur_remain_file_size = 0; // framed data follows instead
+    }
+
+    if (virtualtfa_util_reader_reserve_name(this, this->_cur_h_namesize) != 0) {
+        return 1;
+    }
+    this->_cur_name[this->_cur_h_namesize] = '\0';
+    return 0;
+}
+
+tfa_size_t virtualtfa_util_reader_sparse_map_size(virtualtfa_reader* this) {
+    if (this->_cur_sparse_map_read < tfa_sparse_map_header_size) {
+        return tfa_sparse_map_header_size;
+    }
+    return tfa_sparse_map_header_size +
+           (tfa_size_t) virtualtfa_util_read_u32(this->_cur_sparse_map + 8) * tfa_sparse_extent_size;
+}
+
+int virtualtfa_util_reader_reserve_sparse_map(virtualtfa_reader* this, tfa_size_t size) {
+    if (this->_cur_sparse_map_capacity >= size) {
+        return 0;
+    }
+    char* sparse_map = (char*) realloc(this->_cur_sparse_map, size);
+    if (!sparse_map) {
+        fprintf(stderr, "virtualtfa_reader_read: memory allocation failed\n");
+        return 1;
+    }
+    this->_cur_sparse_map = sparse_map;
+    this->_cur_sparse_map_capacity = size;
+    return 0;
+}
+
+// Collect the extent map, then write every data extent at its offset leaving holes in between
+int virtualtfa_util_reader_write_sparse(virtualtfa_reader* this, const char* buffer, tfa_size_t buffer_size) {
+    while (buffer_size > 0) {
+        tfa_size_t map_size = virtualtfa_util_reader_sparse_map_size(this);
+        if (this->_cur_sparse_map_read < map_size) {
+            if (map_size > this->_cur_h_filesize) {
+                fprintf(stderr, "virtualtfa_reader_read: invalid sparse map\n");
+                return 1;
+            }
+            if (virtualtfa_util_reader_reserve_sparse_map(this, map_size) != 0) {
+                return 1;
+            }
+            tfa_size_t to_read = MIN(map_size - this->_cur_sparse_map_read, buffer_size);
+            memcpy(this->_cur_sparse_map + this->_cur_sparse_map_read, buffer, to_read);
+            this->_cur_sparse_map_read += to_read;
+            buffer += to_read;
+            buffer_size -= to_read;
+            continue;
+        }
+
+        uint32_t extents_size = virtualtfa_util_read_u32(this->_cur_sparse_map + 8);
+        if (this->_cur_sparse_extent >= extents_size) {
+            fprintf(stderr, "virtualtfa_reader_read: sparse data exceeds the extent map\n");
+            return 1;
+        }
+        const char* extent = this->_cur_sparse_map + tfa_sparse_map_header_size +
+                             this->_cur_sparse_extent * tfa_sparse_extent_size;
+        tfa_size_t extent_offset = virtualtfa_util_read_u64(extent);
+        tfa_size_t extent_length = virtualtfa_util_read_u64(extent + 8);
+        tfa_size_t to_write = MIN(extent_length - this->_cur_sparse_extent_pos, buffer_size);
+        if (virtualtfa_util_fseek(this->_cur_ofs, extent_offset + this->_cur_sparse_extent_pos) != 0) {
+            fprintf(stderr, "virtualtfa_reader_read: seek error\n");
+            return 1;
+        }
+        fwrite(buffer, 1, to_write, this->_cur_ofs);
+        this->_cur_sparse_extent_pos += to_write;
+        buffer += to_write;
+        buffer_size -= to_write;
+        if (this->_cur_sparse_extent_pos == extent_length) {
+            this->_cur_sparse_extent++;
+            this->_cur_sparse_extent_pos = 0;
+        }
+    }
+    return 0;
+}
+
+// Finish the current entry once all of its file data is written
+void virtualtfa_util_reader_end_entry(virtualtfa_reader* this) {
+    if (this->_cur_ofs && this->_cur_h_typeflag == VIRTUALTFA_TYPEFLAG_SPARSE) {
+        // trailing hole, the file was created empty so every other hole already exists
+        virtualtfa_util_truncate_file(this->_cur_ofs, virtualtfa_util_read_u64(this->_cur_sparse_map));
+    }
+    if (this->_cur_ofs) {
+        fclose(this->_cur_ofs);
+        this->_cur_ofs = NULL;
+    }
+
+    this->_cur_remain_header_size = tfa_header_size;
+
+    if (this->_cur_skip) {
+        this->_cur_skip = false;
+        if (this->skipped_function) {
+            virtualtfa_file_info fileinfo = virtualtfa_util_file_info_constructor(this->_cur_name,
+                                                                                    this->_cur_h_filesize,
+                                                                                    this->_cur_h_ctime,
+                                                                                    this->_cur_h_mtime);
+            this->skipped_function(this->skipped_userdata, &fileinfo);
+        }
+        return;
+    }
+
+    char filepath[1024];
+    snprintf(filepath, sizeof(filepath), "%s/%s", this->dest, this->_cur_name);
+
+    virtualtfa_util_set_file_metadata(filepath, this->_cur_h_mode, this->_cur_h_ctime, this->_cur_h_mtime);
+
+    if (this->listener) {
+        virtualtfa_file_info fileinfo = virtualtfa_util_file_info_constructor(this->_cur_name,
+                                                                                this->_cur_h_filesize,
+                                                                                this->_cur_h_ctime,
+                                                                                this->_cur_h_mtime);
+        this->listener->file_end(this->listener->file_end_userdata, &fileinfo);
+    }
+}
+
 int virtualtfa_reader_read(virtualtfa_reader* this, char* buffer, tfa_size_t buffer_size, tfa_size_t* out_bytes_read) {
     tfa_size_t bytes_read = 0;
     tfa_size_t buffer_size_left = buffer_size;
 
+    if (this->_failed) {
+        fprintf(stderr, "virtualtfa_reader_read: reader failed earlier\n");
+        buffer_size_left = 0;
+    }
+
     while (buffer_size_left > 0) {
         // Header
-        if (this->_cur_remain_header_size > 0) {
+        if (this->_cur_remain_header_size == tfa_header_size && buffer_size_left >= tfa_header_size) {
+            // whole header in the caller buffer, decode in place
+            if (virtualtfa_util_reader_decode_header(this, buffer + bytes_read) != 0) {
+                this->_failed = true;
+                break;
+            }
+            buffer_size_left -= tfa_header_size;
+            bytes_read += tfa_header_size;
+            if (bytes_read == buffer_size) break;
+        } else if (this->_cur_remain_header_size > 0) {
+            // header split across calls, stage it
             tfa_size_t buffer_offset = tfa_header_size - this->_cur_remain_header_size;
 
             tfa_size_t to_read = MIN(this->_cur_remain_header_size, buffer_size_left);
@@ -651,45 +2049,10 @@ int virtualtfa_reader_read(virtualtfa_reader* this, char* buffer, tfa_size_t buf
             buffer_size_left -= to_read;
             bytes_read += to_read;
 
-            if (this->_cur_remain_header_size == 0) {
-                //printf("Header buffered, reading ...\n");
-
-                tfa_header header = {0};
-                tfa_size_t deserialize_cursor = 0;
-
-                memcpy(header.magic, this->_cur_header_buf + deserialize_cursor, sizeof(header.magic));
-                deserialize_cursor += sizeof(header.magic);
-                header.version = this->_cur_header_buf[deserialize_cursor];
-                deserialize_cursor++;
-                header.typeflag = this->_cur_header_buf[deserialize_cursor];
-                deserialize_cursor++;
-                memcpy(header.reserved, this->_cur_header_buf + deserialize_cursor, sizeof(header.reserved));
-                deserialize_cursor += sizeof(header.reserved);
-                memcpy(header.mode, this->_cur_header_buf + deserialize_cursor, sizeof(header.mode));
-                deserialize_cursor += sizeof(header.mode);
-                memcpy(header.ctime, this->_cur_header_buf + deserialize_cursor, sizeof(header.ctime));
-                deserialize_cursor += sizeof(header.ctime);
-                memcpy(header.mtime, this->_cur_header_buf + deserialize_cursor, sizeof(header.mtime));
-                deserialize_cursor += sizeof(header.mtime);
-                memcpy(header.namesize, this->_cur_header_buf + deserialize_cursor, sizeof(header.namesize));
-                deserialize_cursor += sizeof(header.namesize);
-                memcpy(header.filesize, this->_cur_header_buf + deserialize_cursor, sizeof(header.filesize));
-
-                // TODO: check magic
-
-                // TODO: rethink about permissions
-                this->_cur_h_mode = (tfa_mode_t) virtualtfa_util_read_i32(header.mode);
-
-                this->_cur_h_ctime = virtualtfa_util_read_u64(header.ctime);
-                this->_cur_h_mtime = virtualtfa_util_read_u64(header.mtime);
-
-              this->_cur_remain_name_size = this->_cur_h_namesize = virtualtfa_util_read_u32(header.namesize);
-              this->_cur_remain_file_size = this->_cur_h_filesize = virtualtfa_util_read_u32(header.filesize);
-
-                this->_cur_name = (char*) malloc(this->_cur_h_namesize + 1);
-                this->_cur_name[this->_cur_h_namesize] = '\0';
-
-                //printf("Header readed\n");
+            if (this->_cur_remain_header_size == 0 &&
+                virtualtfa_util_reader_decode_header(this, this->_cur_header_buf) != 0) {
+                this->_failed = true;
+                break;
             }
             if (bytes_read == buffer_size) break;
         }
@@ -710,8 +2073,27 @@ int virtualtfa_reader_read(virtualtfa_reader* this, char* buffer, tfa_size_t buf
             if (this->_cur_remain_name_size == 0) {
                 if (!virtualtfa_util_is_path_valid(this->_cur_name)) {
                     fprintf(stderr, "virtualtfa_reader_read: invalid file name\n");
+                    this->_failed = true;
                     break;
                 }
+                char filepath[1024];
+                snprintf(filepath, sizeof(filepath), "%s/%s", this->dest, this->_cur_name);
+                if (this->_cur_h_typeflag == VIRTUALTFA_TYPEFLAG_DELETED) {
+                    remove(filepath);
+                    this->_cur_remain_header_size = tfa_header_size;
+                    this->_cur_remain_file_size = 0;
+                    if (bytes_read == buffer_size) break;
+                    continue;
+                }
+                if (this->skip_unchanged && this->_cur_h_typeflag == VIRTUALTFA_TYPEFLAG_FILE &&
+                    virtualtfa_util_reader_is_unchanged(this, filepath)) {
+                    this->_cur_skip = true;
+                    if (this->_cur_h_filesize == 0) {
+                        virtualtfa_util_reader_end_entry(this);
+                    }
+                    if (bytes_read == buffer_size) break;
+                    continue;
+                }
                 if (this->listener) {
                     virtualtfa_file_info fileinfo = virtualtfa_util_file_info_constructor(this->_cur_name,
                                                                                             this->_cur_h_filesize,
@@ -719,6 +2101,26 @@ int virtualtfa_reader_read(virtualtfa_reader* this, char* buffer, tfa_size_t buf
                                                                                             this->_cur_h_mtime);
                     this->listener->file_start(this->listener->file_start_userdata, &fileinfo);
                 }
+                if (this->_cur_h_typeflag == VIRTUALTFA_TYPEFLAG_CHUNKED) {
+                    if ((this->_cur_ofs = fopen(filepath, "wb")) == NULL) {
+                        fprintf(stderr, "virtualtfa_reader_read: failed to open the file %s\n", filepath);
+                        this->_failed = true;
+                        break;
+                    }
+                    this->_cur_remain_chunk_prefix_size = sizeof(this->_cur_chunk_prefix_buf);
+                    this->_cur_chunk_data_size = 0;
+                } else if (this->_cur_h_typeflag == VIRTUALTFA_TYPEFLAG_SPARSE) {
+                    this->_cur_sparse_map_read = 0;
+                    this->_cur_sparse_extent = 0;
+                    this->_cur_sparse_extent_pos = 0;
+                } else if (this->_cur_h_filesize == 0) { // no file data part follows
+                    if ((this->_cur_ofs = fopen(filepath, "wb")) == NULL) {
+                        fprintf(stderr, "virtualtfa_reader_read: failed to open the file %s\n", filepath);
+                        this->_failed = true;
+                        break;
+                    }
+                    virtualtfa_util_reader_end_entry(this);
+                }
                 //printf("Reading %s ...\n", this->_cur_name);
             }
             if (bytes_read == buffer_size) break;
@@ -726,13 +2128,14 @@ int virtualtfa_reader_read(virtualtfa_reader* this, char* buffer, tfa_size_t buf
 
         // File Data
         if (this->_cur_remain_file_size > 0) {
-            if (!this->_cur_ofs) {
+            if (!this->_cur_ofs && !this->_cur_skip) {
                 char filepath[1024];
                 snprintf(filepath, sizeof(filepath), "%s/%s", this->dest, this->_cur_name);
                 //printf("%s\n", filepath);
-                if ((this->_cur_ofs = fopen(filepath, "wb")) != 0) {
+                if ((this->_cur_ofs = fopen(filepath, "wb")) == NULL) {
                     fprintf(stderr, "virtualtfa_reader_read: failed to open the file %s\n", filepath);
-                    return 0;
+                    this->_failed = true;
+                    break;
                 }
             }
 
@@ -740,15 +2143,24 @@ int virtualtfa_reader_read(virtualtfa_reader* this, char* buffer, tfa_size_t buf
 
             tfa_size_t to_read = MIN(this->_cur_remain_file_size, buffer_size_left);
 
-            //fseek(this->_cur_ofs, offset, SEEK_SET); // causes bugs
-            fwrite(buffer + bytes_read, 1, to_read, this->_cur_ofs);
+            if (this->_cur_skip) {
+                // identical bytes are already on disk
+            } else if (this->_cur_h_typeflag == VIRTUALTFA_TYPEFLAG_SPARSE) {
+                if (virtualtfa_util_reader_write_sparse(this, buffer + bytes_read, to_read) != 0) {
+                    this->_failed = true;
+                    break;
+                }
+            } else {
+                //fseek(this->_cur_ofs, offset, SEEK_SET); // causes bugs
+                fwrite(buffer + bytes_read, 1, to_read, this->_cur_ofs);
+            }
 
             this->_cur_remain_file_size -= to_read;
 
             buffer_size_left -= to_read;
             bytes_read += to_read;
 
-            if (this->listener) {
+            if (this->listener && !this->_cur_skip) {
                 virtualtfa_file_info fileinfo = virtualtfa_util_file_info_constructor(this->_cur_name,
                                                                                         this->_cur_h_filesize,
                                                                                         this->_cur_h_ctime,
@@ -757,25 +2169,56 @@ int virtualtfa_reader_read(virtualtfa_reader* this, char* buffer, tfa_size_t buf
                                               this->_cur_h_filesize - this->_cur_remain_file_size);
             }
             if (this->_cur_remain_file_size == 0) {
-                fclose(this->_cur_ofs);
-                this->_cur_ofs = NULL;
+                virtualtfa_util_reader_end_entry(this);
+            }
+            if (bytes_read == buffer_size) break;
+        }
 
-                char filepath[1024];
-                snprintf(filepath, sizeof(filepath), "%s/%s", this->dest, this->_cur_name);
+        // Chunked File Data
+        while (buffer_size_left > 0 && (this->_cur_remain_chunk_prefix_size > 0 || this->_cur_remain_chunk_size > 0)) {
+            if (this->_cur_remain_chunk_size > 0) {
+                tfa_size_t to_read = MIN(this->_cur_remain_chunk_size, buffer_size_left);
 
-                virtualtfa_util_set_file_metadata(filepath, this->_cur_h_mode, this->_cur_h_ctime, this->_cur_h_mtime);
+                fwrite(buffer + bytes_read, 1, to_read, this->_cur_ofs);
 
-                this->_cur_remain_header_size = tfa_header_size;
+                this->_cur_remain_chunk_size -= (uint32_t) to_read;
+                this->_cur_chunk_data_size += to_read;
+
+                buffer_size_left -= to_read;
+                bytes_read += to_read;
 
                 if (this->listener) {
                     virtualtfa_file_info fileinfo = virtualtfa_util_file_info_constructor(this->_cur_name,
-                                                                                            this->_cur_h_filesize,
+                                                                                            VIRTUALTFA_SIZE_UNKNOWN,
                                                                                             this->_cur_h_ctime,
                                                                                             this->_cur_h_mtime);
-                    this->listener->file_end(this->listener->file_end_userdata, &fileinfo);
+                    this->listener->file_progress(this->listener->file_progress_userdata, &fileinfo,
+                                                  this->_cur_chunk_data_size);
+                }
+                if (this->_cur_remain_chunk_size == 0) {
+                    this->_cur_remain_chunk_prefix_size = sizeof(this->_cur_chunk_prefix_buf);
+                }
+                continue;
+            }
+
+            tfa_size_t buffer_offset = sizeof(this->_cur_chunk_prefix_buf) - this->_cur_remain_chunk_prefix_size;
+
+            tfa_size_t to_read = MIN(this->_cur_remain_chunk_prefix_size, buffer_size_left);
+
+            memcpy(this->_cur_chunk_prefix_buf + buffer_offset, buffer + bytes_read, to_read);
+
+            this->_cur_remain_chunk_prefix_size -= to_read;
+
+            buffer_size_left -= to_read;
+            bytes_read += to_read;
+
+            if (this->_cur_remain_chunk_prefix_size == 0) {
+                this->_cur_remain_chunk_size = virtualtfa_util_read_u32(this->_cur_chunk_prefix_buf);
+                if (this->_cur_remain_chunk_size == 0) { // terminator
+                    this->_cur_h_filesize = this->_cur_chunk_data_size;
+                    virtualtfa_util_reader_end_entry(this);
                 }
             }
-            if (bytes_read == buffer_size) break;
         }
     }
 
@@ -788,6 +2231,497 @@ int virtualtfa_reader_read(virtualtfa_reader* this, char* buffer, tfa_size_t buf
         *out_bytes_read = bytes_read;
     }
 
+    return this->_failed ? 1 : 0;
+}
+
+int virtualtfa_util_add_spooled_range(virtualtfa_reader* this, tfa_size_t start, tfa_size_t end) {
+    size_t i = 0;
+    while (i < this->_spooled_size && this->_spooled[i].end < start) {
+        i++;
+    }
+    // merge every range touching [start, end)
+    size_t j = i;
+    while (j < this->_spooled_size && this->_spooled[j].start <= end) {
+        start = MIN(start, this->_spooled[j].start);
+        end = this->_spooled[j].end > end ? this->_spooled[j].end : end;
+        j++;
+    }
+    if (j == i) {
+        virtualtfa_range* new_spooled = (virtualtfa_range*) realloc(this->_spooled,
+                                                                    (this->_spooled_size + 1) * sizeof(virtualtfa_range));
+        if (!new_spooled) {
+            fprintf(stderr, "virtualtfa_reader_read_at: memory allocation failed\n");
+            return 1;
+        }
+        this->_spooled = new_spooled;
+        memmove(this->_spooled + i + 1, this->_spooled + i, (this->_spooled_size - i) * sizeof(virtualtfa_range));
+        this->_spooled_size++;
+    } else if (j > i + 1) {
+        memmove(this->_spooled + i + 1, this->_spooled + j, (this->_spooled_size - j) * sizeof(virtualtfa_range));
+        this->_spooled_size -= j - i - 1;
+    }
+    this->_spooled[i].start = start;
+    this->_spooled[i].end = end;
+    return 0;
+}
+
+// Feed spooled ranges that became contiguous with the parsed stream
+int virtualtfa_util_drain_spool(virtualtfa_reader* this) {
+    char buffer[65536];
+    while (this->_spooled_size > 0 && this->_spooled[0].start <= this->_total_read) {
+        tfa_size_t end = this->_spooled[0].end;
+        while (this->_total_read < end) {
+            tfa_size_t to_read = MIN(end - this->_total_read, sizeof(buffer));
+            if (virtualtfa_util_fseek(this->spool, this->_total_read) != 0 ||
+                fread(buffer, 1, to_read, this->spool) != to_read) {
+                fprintf(stderr, "virtualtfa_reader_read_at: spool read error\n");
+                return 1;
+            }
+            tfa_size_t bytes_read = 0;
+            if (virtualtfa_reader_read(this, buffer, to_read, &bytes_read) != 0 || bytes_read != to_read) {
+                return 1;
+            }
+        }
+        memmove(this->_spooled, this->_spooled + 1, (this->_spooled_size - 1) * sizeof(virtualtfa_range));
+        this->_spooled_size--;
+    }
+    return 0;
+}
+
+// Accept one range, consumed counts the bytes parsed or spooled so far even when an error is returned
+int virtualtfa_util_read_at(virtualtfa_reader* this,
+                            tfa_size_t offset,
+                            char* buffer,
+                            tfa_size_t buffer_size,
+                            tfa_size_t* consumed) {
+    if (offset + buffer_size <= this->_total_read) { // already parsed
+        *consumed = buffer_size;
+        return 0;
+    }
+    if (offset < this->_total_read) {
+        *consumed = this->_total_read - offset;
+        buffer += *consumed;
+        buffer_size -= *consumed;
+        offset = this->_total_read;
+    }
+
+    if (offset == this->_total_read) {
+        tfa_size_t bytes_read = 0;
+        int result = virtualtfa_reader_read(this, buffer, buffer_size, &bytes_read);
+        *consumed += bytes_read;
+        if (result != 0 || bytes_read != buffer_size) {
+            return 1;
+        }
+        return virtualtfa_util_drain_spool(this);
+    }
+
+    // Ahead of the parsed stream, keep it in the spool until the gap is filled
+    if (!this->spool) {
+        fprintf(stderr, "virtualtfa_reader_read_at: out of order range without spool\n");
+        return 1;
+    }
+    if (virtualtfa_util_fseek(this->spool, offset) != 0 ||
+        fwrite(buffer, 1, buffer_size, this->spool) != buffer_size) {
+        fprintf(stderr, "virtualtfa_reader_read_at: spool write error\n");
+        return 1;
+    }
+    if (virtualtfa_util_add_spooled_range(this, offset, offset + buffer_size) != 0) {
+        return 1;
+    }
+    *consumed += buffer_size;
+    return 0;
+}
+
+int virtualtfa_reader_read_at(virtualtfa_reader* this,
+                              tfa_size_t offset,
+                              char* buffer,
+                              tfa_size_t buffer_size,
+                              tfa_size_t* out_bytes_read) {
+    tfa_size_t consumed = 0;
+    int result = virtualtfa_util_read_at(this, offset, buffer, buffer_size, &consumed);
+    if (out_bytes_read) {
+        *out_bytes_read = consumed;
+    }
+    return result;
+}
+
+#if defined(__linux__)
+
+#define VIRTUALTFA_PIPE_SIZE (1024 * 1024)
+
+// Move file data from in_fd to the current file through the pipe, returns the bytes moved, 0 at EOF
+// and -1 on error or when in_fd would block (errno tells which)
+ssize_t virtualtfa_util_reader_splice(virtualtfa_reader* this, int in_fd, tfa_size_t size) {
+    if (this->_pipe[0] < 0) {
+        if (pipe2(this->_pipe, O_CLOEXEC) != 0) {
+            fprintf(stderr, "virtualtfa_reader_read_from_fd: unable to create pipe\n");
+            return -1;
+        }
+        fcntl(this->_pipe[1], F_SETPIPE_SZ, VIRTUALTFA_PIPE_SIZE); // best effort
+    }
+    ssize_t moved = splice(in_fd, NULL, this->_pipe[1], NULL, size, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (moved <= 0) {
+        return moved;
+    }
+    loff_t offset = (loff_t) (this->_cur_h_filesize - this->_cur_remain_file_size);
+    ssize_t left = moved;
+    while (left > 0) {
+        ssize_t written = splice(this->_pipe[0], NULL, fileno(this->_cur_ofs), &offset, left, SPLICE_F_MOVE);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "virtualtfa_reader_read_from_fd: splice to file failed\n");
+            errno = EIO; // the pipe still holds data, this is not retriable
+            this->_failed = true;
+            return -1;
+        }
+        left -= written;
+    }
+    return moved;
+}
+
+int virtualtfa_reader_read_from_fd(virtualtfa_reader* this, int in_fd, tfa_size_t max_bytes, tfa_size_t* out_bytes_read) {
+    char buffer[4096];
+    tfa_size_t bytes_read = 0;
+    int result = 0;
+
+    if (this->_failed) {
+        fprintf(stderr, "virtualtfa_reader_read_from_fd: reader failed earlier\n");
+        result = 1;
+        max_bytes = 0;
+    }
+
+    while (bytes_read < max_bytes) {
+        tfa_size_t max_left = max_bytes - bytes_read;
+        ssize_t moved;
+        if (this->_cur_remain_header_size == 0 && this->_cur_remain_name_size == 0 && !this->_cur_skip &&
+            this->_cur_h_typeflag == VIRTUALTFA_TYPEFLAG_FILE && this->_cur_remain_file_size > 0) {
+            // File Data, socket to pipe to file without entering userspace
+            if (!this->_cur_ofs) {
+                char filepath[1024];
+                snprintf(filepath, sizeof(filepath), "%s/%s", this->dest, this->_cur_name);
+                if ((this->_cur_ofs = fopen(filepath, "wb")) == NULL) {
+                    fprintf(stderr, "virtualtfa_reader_read_from_fd: failed to open the file %s\n", filepath);
+                    this->_failed = true;
+                    result = 1;
+                    break;
+                }
+            }
+            fflush(this->_cur_ofs); // bytes written through the stream by virtualtfa_reader_read
+            moved = virtualtfa_util_reader_splice(this, in_fd, MIN(this->_cur_remain_file_size, max_left));
+            if (moved > 0) {
+                this->_cur_remain_file_size -= moved;
+                this->_total_read += moved;
+                bytes_read += moved;
+                if (this->listener) {
+                    virtualtfa_file_info fileinfo = virtualtfa_util_file_info_constructor(this->_cur_name,
+                                                                                            this->_cur_h_filesize,
+                                                                                            this->_cur_h_ctime,
+                                                                                            this->_cur_h_mtime);
+                    this->listener->file_progress(this->listener->file_progress_userdata, &fileinfo,
+                                                  this->_cur_h_filesize - this->_cur_remain_file_size);
+                    this->listener->total_progress(this->listener->total_progress_userdata, this->_total_read);
+                }
+                if (this->_cur_remain_file_size == 0) {
+                    virtualtfa_util_reader_end_entry(this);
+                } else if (virtualtfa_util_fseek(this->_cur_ofs, this->_cur_h_filesize - this->_cur_remain_file_size) !=
+                           0) { // keep the stream in step for virtualtfa_reader_read
+                    fprintf(stderr, "virtualtfa_reader_read_from_fd: seek error\n");
+                    this->_failed = true;
+                    result = 1;
+                    break;
+                }
+                continue;
+            }
+        } else {
+            // Everything else goes through virtualtfa_reader_read, never reading past the next file data
+            tfa_size_t to_read;
+            if (this->_cur_remain_header_size > 0) {
+                to_read = this->_cur_remain_header_size;
+            } else if (this->_cur_remain_name_size > 0) {
+                to_read = this->_cur_remain_name_size;
+            } else if (this->_cur_remain_chunk_size > 0) {
+                to_read = this->_cur_remain_chunk_size;
+            } else if (this->_cur_remain_chunk_prefix_size > 0) {
+                to_read = this->_cur_remain_chunk_prefix_size;
+            } else {
+                to_read = this->_cur_remain_file_size; // sparse map and extents
+            }
+            to_read = MIN(MIN(to_read, max_left), sizeof(buffer));
+            moved = read(in_fd, buffer, to_read);
+            if (moved > 0) {
+                tfa_size_t fed = 0;
+                result = virtualtfa_reader_read(this, buffer, moved, &fed);
+                bytes_read += fed;
+                if (result != 0) {
+                    break;
+                }
+                if (fed != (tfa_size_t) moved) {
+                    fprintf(stderr, "virtualtfa_reader_read_from_fd: input not consumed\n");
+                    this->_failed = true;
+                    result = 1;
+                    break;
+                }
+                continue;
+            }
+        }
+        if (moved == 0) break; // end of input
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            fprintf(stderr, "virtualtfa_reader_read_from_fd: read error\n");
+            result = 1;
+        }
+        break;
+    }
+
+    if (out_bytes_read) {
+        *out_bytes_read = bytes_read;
+    }
+    return result;
+}
+
+#endif
+
+/*
+ * Reader checkpoint
+ *
+ * | magic "tfack" | version | total_read | remain_header (1 byte) | header bytes received |
+ * or, once the header is decoded, remain_header = 0 followed by:
+ * | typeflag | hash | mode | ctime | mtime | namesize | remain_name | name bytes received | filesize | remain_file |
+ * and for chunked entries:
+ * | remain_chunk_prefix (1 byte) | chunk prefix bytes received | remain_chunk | chunk_data |
+ * and for sparse entries:
+ * | sparse_map_read | sparse map bytes received | sparse_extent | sparse_extent_pos |
+ */
+
+const char virtualtfa_checkpoint_magic[5] = {'t', 'f', 'a', 'c', 'k'};
+
+#define VIRTUALTFA_CHECKPOINT_VERSION 0
+
+tfa_size_t virtualtfa_util_calc_checkpoint_size(virtualtfa_reader* this) {
+    tfa_size_t size = sizeof(virtualtfa_checkpoint_magic) + 1 + 8 + 1;
+    if (this->_cur_remain_header_size > 0) {
+        size += tfa_header_size - this->_cur_remain_header_size;
+    } else {
+        size += 1 + 8 + 4 + 8 + 8 + 4 + 4 + 8 + 8;
+        size += this->_cur_h_namesize - this->_cur_remain_name_size;
+        if (this->_cur_h_typeflag == VIRTUALTFA_TYPEFLAG_CHUNKED) {
+            size += 1 + (4 - this->_cur_remain_chunk_prefix_size) + 4 + 8;
+        }
+        if (this->_cur_h_typeflag == VIRTUALTFA_TYPEFLAG_SPARSE) {
+            size += 8 + this->_cur_sparse_map_read + 4 + 8;
+        }
+    }
+    return size;
+}
+
+int virtualtfa_reader_checkpoint(virtualtfa_reader* this,
+                                 char* buffer,
+                                 tfa_size_t buffer_size,
+                                 tfa_size_t* out_checkpoint_size) {
+    tfa_size_t checkpoint_size = virtualtfa_util_calc_checkpoint_size(this);
+    if (out_checkpoint_size) {
+        *out_checkpoint_size = checkpoint_size;
+    }
+    if (!buffer || buffer_size < checkpoint_size) {
+        return 1;
+    }
+    if (this->_failed) {
+        fprintf(stderr, "virtualtfa_reader_checkpoint: reader failed earlier\n");
+        return 1;
+    }
+    // file data written so far must be on disk before the offset is reported
+    if (this->_cur_ofs && virtualtfa_util_sync_file(this->_cur_ofs) != 0) {
+        fprintf(stderr, "virtualtfa_reader_checkpoint: sync error\n");
+        return 1;
+    }
+
+    tfa_size_t cursor = 0;
+    memcpy(buffer + cursor, virtualtfa_checkpoint_magic, sizeof(virtualtfa_checkpoint_magic));
+    cursor += sizeof(virtualtfa_checkpoint_magic);
+    buffer[cursor++] = VIRTUALTFA_CHECKPOINT_VERSION;
+    virtualtfa_util_write_u64(buffer + cursor, this->_total_read);
+    cursor += 8;
+    buffer[cursor++] = (char) this->_cur_remain_header_size;
+    if (this->_cur_remain_header_size > 0) {
+        memcpy(buffer + cursor, this->_cur_header_buf, tfa_header_size - this->_cur_remain_header_size);
+        cursor += tfa_header_size - this->_cur_remain_header_size;
+    } else {
+        buffer[cursor++] = (char) this->_cur_h_typeflag;
+        virtualtfa_util_write_u64(buffer + cursor, this->_cur_h_hash);
+        cursor += 8;
+        virtualtfa_util_write_i32(buffer + cursor, this->_cur_h_mode);
+        cursor += 4;
+        virtualtfa_util_write_u64(buffer + cursor, this->_cur_h_ctime);
+        cursor += 8;
+        virtualtfa_util_write_u64(buffer + cursor, this->_cur_h_mtime);
+        cursor += 8;
+        virtualtfa_util_write_u32(buffer + cursor, this->_cur_h_namesize);
+        cursor += 4;
+        virtualtfa_util_write_u32(buffer + cursor, this->_cur_remain_name_size);
+        cursor += 4;
+        memcpy(buffer + cursor, this->_cur_name, this->_cur_h_namesize - this->_cur_remain_name_size);
+        cursor += this->_cur_h_namesize - this->_cur_remain_name_size;
+        virtualtfa_util_write_u64(buffer + cursor, this->_cur_h_filesize);
+        cursor += 8;
+        virtualtfa_util_write_u64(buffer + cursor, this->_cur_remain_file_size);
+        cursor += 8;
+        if (this->_cur_h_typeflag == VIRTUALTFA_TYPEFLAG_CHUNKED) {
+            tfa_size_t prefix_read = 4 - this->_cur_remain_chunk_prefix_size;
+            buffer[cursor++] = (char) this->_cur_remain_chunk_prefix_size;
+            memcpy(buffer + cursor, this->_cur_chunk_prefix_buf, prefix_read);
+            cursor += prefix_read;
+            virtualtfa_util_write_u32(buffer + cursor, this->_cur_remain_chunk_size);
+            cursor += 4;
+            virtualtfa_util_write_u64(buffer + cursor, this->_cur_chunk_data_size);
+            cursor += 8;
+        }
+        if (this->_cur_h_typeflag == VIRTUALTFA_TYPEFLAG_SPARSE) {
+            virtualtfa_util_write_u64(buffer + cursor, this->_cur_sparse_map_read);
+            cursor += 8;
+            memcpy(buffer + cursor, this->_cur_sparse_map, this->_cur_sparse_map_read);
+            cursor += this->_cur_sparse_map_read;
+            virtualtfa_util_write_u32(buffer + cursor, this->_cur_sparse_extent);
+            cursor += 4;
+            virtualtfa_util_write_u64(buffer + cursor, this->_cur_sparse_extent_pos);
+            cursor += 8;
+        }
+    }
     return 0;
 }
 
+int virtualtfa_reader_restore(virtualtfa_reader* this, const char* buffer, tfa_size_t buffer_size) {
+    tfa_size_t cursor = 0;
+    if (buffer_size < sizeof(virtualtfa_checkpoint_magic) + 1 + 8 + 1 ||
+        memcmp(buffer, virtualtfa_checkpoint_magic, sizeof(virtualtfa_checkpoint_magic)) != 0 ||
+        buffer[sizeof(virtualtfa_checkpoint_magic)] != VIRTUALTFA_CHECKPOINT_VERSION) {
+        fprintf(stderr, "virtualtfa_reader_restore: invalid checkpoint\n");
+        return 1;
+    }
+    cursor += sizeof(virtualtfa_checkpoint_magic) + 1;
+    tfa_size_t total_read = virtualtfa_util_read_u64(buffer + cursor);
+    cursor += 8;
+    tfa_size_t remain_header_size = (uint8_t) buffer[cursor++];
+    if (remain_header_size > tfa_header_size ||
+        buffer_size < cursor + (remain_header_size > 0 ? tfa_header_size - remain_header_size : 1 + 8 + 4 + 8 + 8 + 4 + 4)) {
+        fprintf(stderr, "virtualtfa_reader_restore: truncated checkpoint\n");
+        return 1;
+    }
+
+    if (this->_cur_ofs) {
+        fclose(this->_cur_ofs);
+        this->_cur_ofs = NULL;
+    }
+    free(this->_spooled); // spooled ranges are not part of the checkpoint
+    this->_spooled = NULL;
+    this->_spooled_size = 0;
+
+    this->_total_read = total_read;
+    this->_failed = false;
+    this->_cur_skip = false;
+    this->_cur_remain_header_size = remain_header_size;
+    this->_cur_remain_name_size = 0;
+    this->_cur_remain_file_size = 0;
+    this->_cur_remain_chunk_prefix_size = 0;
+    this->_cur_remain_chunk_size = 0;
+    if (remain_header_size > 0) {
+        memcpy(this->_cur_header_buf, buffer + cursor, tfa_header_size - remain_header_size);
+        return 0;
+    }
+
+    this->_cur_h_typeflag = (tfa_typeflag_t) buffer[cursor++];
+    this->_cur_h_hash = virtualtfa_util_read_u64(buffer + cursor);
+    cursor += 8;
+    this->_cur_h_mode = virtualtfa_util_read_i32(buffer + cursor);
+    cursor += 4;
+    this->_cur_h_ctime = virtualtfa_util_read_u64(buffer + cursor);
+    cursor += 8;
+    this->_cur_h_mtime = virtualtfa_util_read_u64(buffer + cursor);
+    cursor += 8;
+    tfa_namesize_t namesize = virtualtfa_util_read_u32(buffer + cursor);
+    cursor += 4;
+    tfa_namesize_t remain_name_size = virtualtfa_util_read_u32(buffer + cursor);
+    cursor += 4;
+    if (remain_name_size > namesize || buffer_size < cursor + (namesize - remain_name_size) + 8 + 8) {
+        fprintf(stderr, "virtualtfa_reader_restore: truncated checkpoint\n");
+        return 1;
+    }
+    if (virtualtfa_util_reader_reserve_name(this, namesize) != 0) {
+        return 1;
+    }
+    this->_cur_h_namesize = namesize;
+    this->_cur_remain_name_size = remain_name_size;
+    memcpy(this->_cur_name, buffer + cursor, namesize - remain_name_size);
+    this->_cur_name[namesize] = '\0';
+    cursor += namesize - remain_name_size;
+    this->_cur_h_filesize = virtualtfa_util_read_u64(buffer + cursor);
+    cursor += 8;
+    this->_cur_remain_file_size = virtualtfa_util_read_u64(buffer + cursor);
+    cursor += 8;
+
+    tfa_size_t file_written = this->_cur_h_filesize - this->_cur_remain_file_size;
+    bool file_open = this->_cur_remain_file_size > 0 && file_written > 0;
+    if (this->_cur_h_typeflag == VIRTUALTFA_TYPEFLAG_CHUNKED) {
+        if (buffer_size < cursor + 1) {
+            fprintf(stderr, "virtualtfa_reader_restore: truncated checkpoint\n");
+            return 1;
+        }
+        tfa_size_t remain_chunk_prefix_size = (uint8_t) buffer[cursor++];
+        if (remain_chunk_prefix_size > 4 || buffer_size < cursor + (4 - remain_chunk_prefix_size) + 4 + 8) {
+            fprintf(stderr, "virtualtfa_reader_restore: truncated checkpoint\n");
+            return 1;
+        }
+        this->_cur_remain_chunk_prefix_size = remain_chunk_prefix_size;
+        memcpy(this->_cur_chunk_prefix_buf, buffer + cursor, 4 - remain_chunk_prefix_size);
+        cursor += 4 - remain_chunk_prefix_size;
+        this->_cur_remain_chunk_size = virtualtfa_util_read_u32(buffer + cursor);
+        cursor += 4;
+        this->_cur_chunk_data_size = virtualtfa_util_read_u64(buffer + cursor);
+        file_written = this->_cur_chunk_data_size;
+        cursor += 8;
+        file_open = true; // created as soon as the name is complete
+    }
+    if (this->_cur_h_typeflag == VIRTUALTFA_TYPEFLAG_SPARSE) {
+        if (buffer_size < cursor + 8) {
+            fprintf(stderr, "virtualtfa_reader_restore: truncated checkpoint\n");
+            return 1;
+        }
+        tfa_size_t sparse_map_read = virtualtfa_util_read_u64(buffer + cursor);
+        cursor += 8;
+        if (sparse_map_read > this->_cur_h_filesize || buffer_size - cursor < sparse_map_read + 4 + 8) {
+            fprintf(stderr, "virtualtfa_reader_restore: truncated checkpoint\n");
+            return 1;
+        }
+        if (virtualtfa_util_reader_reserve_sparse_map(this, sparse_map_read) != 0) {
+            return 1;
+        }
+        memcpy(this->_cur_sparse_map, buffer + cursor, sparse_map_read);
+        this->_cur_sparse_map_read = sparse_map_read;
+        cursor += sparse_map_read;
+        this->_cur_sparse_extent = virtualtfa_util_read_u32(buffer + cursor);
+        cursor += 4;
+        this->_cur_sparse_extent_pos = virtualtfa_util_read_u64(buffer + cursor);
+        cursor += 8;
+    }
+    if (remain_name_size == 0 && this->_cur_h_typeflag != VIRTUALTFA_TYPEFLAG_CHUNKED) {
+        char filepath[1024];
+        snprintf(filepath, sizeof(filepath), "%s/%s", this->dest, this->_cur_name);
+        // a skipped destination was left untouched, so it still matches
+        this->_cur_skip = this->skip_unchanged && this->_cur_h_typeflag == VIRTUALTFA_TYPEFLAG_FILE &&
+                          virtualtfa_util_reader_is_unchanged(this, filepath);
+        file_open = file_open && !this->_cur_skip;
+    }
+    if (remain_name_size == 0 && file_open) {
+        // reopen the partially written file without truncating it
+        char filepath[1024];
+        snprintf(filepath, sizeof(filepath), "%s/%s", this->dest, this->_cur_name);
+        if ((this->_cur_ofs = fopen(filepath, "r+b")) == NULL) {
+            fprintf(stderr, "virtualtfa_reader_restore: failed to open the file %s\n", filepath);
+            return 1;
+        }
+        if (virtualtfa_util_fseek(this->_cur_ofs, file_written) != 0) {
+            fprintf(stderr, "virtualtfa_reader_restore: seek error\n");
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,70 @@
+// Interrupting a reader at every kind of position and resuming it from a checkpoint
+
+#include "test_util.h"
+
+#define FILES_SIZE 3
+
+int main(void) {
+    static const tfa_size_t sizes[FILES_SIZE] = {5000, 0, 200000};
+    static const char* names[FILES_SIZE] = {"first", "empty", "last"};
+    test_file files[FILES_SIZE];
+    virtualtfa_entry* entries[FILES_SIZE];
+    virtualtfa_archive* archive = virtualtfa_archive_new();
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        files[i].data = test_make_data(sizes[i], (unsigned) i + 7);
+        files[i].size = sizes[i];
+        files[i].short_read = 0;
+        entries[i] = test_add_file(archive, names[i], &files[i]);
+    }
+    tfa_size_t archive_size;
+    char* data = test_write_archive(archive, 65536, &archive_size);
+
+    // Inside the first header, the first name, the first data, the second header and the last data
+    const tfa_size_t cuts[] = {10, 50, 1000, 5060, 100000};
+    test_make_dir("checkpoint_out");
+    for (size_t c = 0; c < sizeof(cuts) / sizeof(cuts[0]); ++c) {
+        for (int i = 0; i < FILES_SIZE; ++i) {
+            remove(test_path("checkpoint_out", names[i]));
+        }
+        virtualtfa_reader* reader = virtualtfa_reader_new();
+        virtualtfa_reader_set_dest(reader, "checkpoint_out");
+        test_read_archive(reader, data, cuts[c], 4096);
+
+        // Too small a buffer reports the required size
+        tfa_size_t checkpoint_size = 0;
+        CHECK(virtualtfa_reader_checkpoint(reader, NULL, 0, &checkpoint_size) != 0);
+        CHECK(checkpoint_size > 0);
+        char* checkpoint = (char*) malloc(checkpoint_size);
+        CHECK(virtualtfa_reader_checkpoint(reader, checkpoint, checkpoint_size, &checkpoint_size) == 0);
+        tfa_size_t resume = virtualtfa_reader_get_total_read(reader);
+        CHECK(resume == cuts[c]);
+        virtualtfa_reader_free(reader);
+
+        reader = virtualtfa_reader_new();
+        virtualtfa_reader_set_dest(reader, "checkpoint_out");
+        CHECK(virtualtfa_reader_restore(reader, checkpoint, checkpoint_size) == 0);
+        CHECK(virtualtfa_reader_get_total_read(reader) == resume);
+        test_read_archive(reader, data + resume, archive_size - resume, 4096);
+        CHECK(virtualtfa_reader_get_total_read(reader) == archive_size);
+        virtualtfa_reader_free(reader);
+        free(checkpoint);
+
+        for (int i = 0; i < FILES_SIZE; ++i) {
+            CHECK(test_file_equals(test_path("checkpoint_out", names[i]), files[i].data, files[i].size));
+        }
+    }
+
+    // A damaged checkpoint is refused
+    virtualtfa_reader* reader = virtualtfa_reader_new();
+    virtualtfa_reader_set_dest(reader, "checkpoint_out");
+    CHECK(virtualtfa_reader_restore(reader, "garbage", 7) != 0);
+    virtualtfa_reader_free(reader);
+
+    free(data);
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        free((char*) files[i].data);
+        virtualtfa_entry_free(entries[i]);
+    }
+    virtualtfa_archive_free(archive);
+    return 0;
+}
@@ -0,0 +1,70 @@
+// Chunked entries fed by input streams returning short reads
+
+#include "test_util.h"
+
+#define FILES_SIZE 4
+
+int main(void) {
+    static const char* names[FILES_SIZE] = {"stream", "plain", "empty_stream", "tiny_reads"};
+    static const tfa_size_t sizes[FILES_SIZE] = {250000, 10000, 0, 3000};
+    static const tfa_size_t short_reads[FILES_SIZE] = {1000, 0, 0, 7};
+    test_file files[FILES_SIZE];
+    virtualtfa_entry* entries[FILES_SIZE];
+    virtualtfa_archive* archive = virtualtfa_archive_new();
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        files[i].data = test_make_data(sizes[i], (unsigned) i + 11);
+        files[i].size = sizes[i];
+        files[i].short_read = short_reads[i];
+        entries[i] = test_add_file(archive, names[i], &files[i]);
+        if (i != 1) {
+            virtualtfa_entry_set_typeflag(entries[i], VIRTUALTFA_TYPEFLAG_CHUNKED);
+            virtualtfa_entry_set_size(entries[i], VIRTUALTFA_SIZE_UNKNOWN);
+        }
+    }
+
+    virtualtfa_writer* writer = virtualtfa_writer_new();
+    virtualtfa_writer_set_archive(writer, archive);
+    CHECK(virtualtfa_writer_calc_size(writer) == VIRTUALTFA_SIZE_UNKNOWN);
+    virtualtfa_writer_free(writer);
+
+    test_make_dir("chunked_out");
+    const tfa_size_t write_chunks[] = {4096, 100, 1 << 20};
+    const tfa_size_t read_chunks[] = {1, 4096, 1 << 20};
+    for (size_t c = 0; c < sizeof(write_chunks) / sizeof(write_chunks[0]); ++c) {
+        tfa_size_t archive_size;
+        char* data = test_write_archive(archive, write_chunks[c], &archive_size);
+        for (int i = 0; i < FILES_SIZE; ++i) {
+            remove(test_path("chunked_out", names[i]));
+        }
+        virtualtfa_reader* reader = virtualtfa_reader_new();
+        virtualtfa_reader_set_dest(reader, "chunked_out");
+        test_read_archive(reader, data, archive_size, read_chunks[c]);
+        CHECK(virtualtfa_reader_get_total_read(reader) == archive_size);
+        virtualtfa_reader_free(reader);
+        for (int i = 0; i < FILES_SIZE; ++i) {
+            CHECK(test_file_equals(test_path("chunked_out", names[i]), files[i].size ? files[i].data : "",
+                                   files[i].size));
+        }
+
+        // A chunked entry whose file cannot be created fails the read
+        test_make_dir("chunked_blocked");
+        test_make_dir("chunked_blocked/stream");
+        reader = virtualtfa_reader_new();
+        virtualtfa_reader_set_dest(reader, "chunked_blocked");
+        tfa_size_t bytes_read = 0;
+        CHECK(virtualtfa_reader_read(reader, data, archive_size, &bytes_read) != 0);
+        CHECK(bytes_read == 48 + strlen(names[0]));
+        bytes_read = 1;
+        CHECK(virtualtfa_reader_read(reader, data + 48 + strlen(names[0]), 10, &bytes_read) != 0);
+        CHECK(bytes_read == 0);
+        virtualtfa_reader_free(reader);
+        free(data);
+    }
+
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        free((char*) files[i].data);
+        virtualtfa_entry_free(entries[i]);
+    }
+    virtualtfa_archive_free(archive);
+    return 0;
+}
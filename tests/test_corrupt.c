@@ -0,0 +1,94 @@
+// A corrupt header or sparse map fails the reader for good, whether it arrives whole or split across calls
+
+#include "test_util.h"
+
+static void check_corrupt_header(const char* data, tfa_size_t size) {
+    // Whole header in one call, nothing is consumed
+    virtualtfa_reader* reader = virtualtfa_reader_new();
+    virtualtfa_reader_set_dest(reader, "corrupt_out");
+    tfa_size_t bytes_read = 1;
+    CHECK(virtualtfa_reader_read(reader, (char*) data, size, &bytes_read) != 0);
+    CHECK(bytes_read == 0);
+    CHECK(virtualtfa_reader_get_total_read(reader) == 0);
+    bytes_read = 1;
+    CHECK(virtualtfa_reader_read(reader, (char*) data, size, &bytes_read) != 0);
+    CHECK(bytes_read == 0);
+    virtualtfa_reader_free(reader);
+
+    // Staged header, the staged bytes are consumed and the reader stays failed
+    reader = virtualtfa_reader_new();
+    virtualtfa_reader_set_dest(reader, "corrupt_out");
+    CHECK(virtualtfa_reader_read(reader, (char*) data, 10, &bytes_read) == 0);
+    CHECK(bytes_read == 10);
+    bytes_read = 0;
+    CHECK(virtualtfa_reader_read(reader, (char*) data + 10, size - 10, &bytes_read) != 0);
+    CHECK(bytes_read == 38);
+    CHECK(virtualtfa_reader_get_total_read(reader) == 48);
+    bytes_read = 1;
+    CHECK(virtualtfa_reader_read(reader, (char*) data + 48, size - 48, &bytes_read) != 0);
+    CHECK(bytes_read == 0);
+    virtualtfa_reader_free(reader);
+}
+
+int main(void) {
+    test_make_dir("corrupt_out");
+
+    // Damaged magic
+    test_file file = {test_make_data(1000, 5), 1000, 0};
+    virtualtfa_archive* archive = virtualtfa_archive_new();
+    virtualtfa_entry* entry = test_add_file(archive, "file", &file);
+    tfa_size_t archive_size;
+    char* data = test_write_archive(archive, 4096, &archive_size);
+    data[0] ^= 1;
+    check_corrupt_header(data, archive_size);
+    free(data);
+
+    // An empty name would never leave the name phase
+    test_file empty = {"", 0, 0};
+    virtualtfa_archive* unnamed = virtualtfa_archive_new();
+    virtualtfa_entry* unnamed_entry = test_add_file(unnamed, "", &empty);
+    virtualtfa_archive_add(unnamed, entry);
+    data = test_write_archive(unnamed, 4096, &archive_size);
+    CHECK(archive_size == 48 + 48 + 4 + 1000);
+    check_corrupt_header(data, archive_size);
+    free(data);
+    virtualtfa_archive_free(unnamed);
+    virtualtfa_entry_free(unnamed_entry);
+
+    // A sparse entry too small to hold its map would never end
+    virtualtfa_archive* sparse = virtualtfa_archive_new();
+    virtualtfa_entry* sparse_entry = test_add_file(sparse, "sparse", &empty);
+    virtualtfa_archive_add(sparse, entry);
+    data = test_write_archive(sparse, 4096, &archive_size);
+    data[7] = VIRTUALTFA_TYPEFLAG_SPARSE;
+    check_corrupt_header(data, archive_size);
+    free(data);
+
+    // A map announcing more extents than the entry holds
+    char map[12 + 16] = {0};
+    map[7] = 100; // logical size
+    map[10] = 1000 >> 8; // extent count
+    map[11] = (char) (1000 & 0xff);
+    test_file map_file = {map, sizeof(map), 0};
+    virtualtfa_entry_set_size(sparse_entry, sizeof(map));
+    virtualtfa_entry_set_input_stream_supplier_userdata(sparse_entry, &map_file);
+    data = test_write_archive(sparse, 4096, &archive_size);
+    data[7] = VIRTUALTFA_TYPEFLAG_SPARSE;
+    virtualtfa_reader* reader = virtualtfa_reader_new();
+    virtualtfa_reader_set_dest(reader, "corrupt_out");
+    tfa_size_t bytes_read = 0;
+    CHECK(virtualtfa_reader_read(reader, data, archive_size, &bytes_read) != 0);
+    CHECK(bytes_read < 48 + 6 + sizeof(map));
+    bytes_read = 1;
+    CHECK(virtualtfa_reader_read(reader, data + archive_size - 1, 1, &bytes_read) != 0);
+    CHECK(bytes_read == 0);
+    virtualtfa_reader_free(reader);
+    free(data);
+    virtualtfa_archive_free(sparse);
+    virtualtfa_entry_free(sparse_entry);
+
+    free((char*) file.data);
+    virtualtfa_entry_free(entry);
+    virtualtfa_archive_free(archive);
+    return 0;
+}
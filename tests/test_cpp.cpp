@@ -0,0 +1,176 @@
+// C++ layer: moved handles, exceptions thrown from callbacks and coroutine awaitables
+
+#include "virtualtfa.hpp"
+
+#include <coroutine>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#define CHECK(condition)                                                                  \
+    do {                                                                                  \
+        if (!(condition)) {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1);                                                                      \
+        }                                                                                 \
+    } while (0)
+
+namespace {
+
+struct memory_source {
+    const std::string* data;
+    std::size_t pos = 0;
+
+    std::size_t read(std::span<char> buffer) {
+        std::size_t n = std::min(buffer.size(), data->size() - pos);
+        std::memcpy(buffer.data(), data->data() + pos, n);
+        pos += n;
+        return n;
+    }
+};
+
+struct throwing_source {
+    std::size_t read(std::span<char>) { throw std::out_of_range("source failed"); }
+};
+
+struct counting_listener {
+    int files_ended = 0;
+    tfa_size_t total = 0;
+
+    void total_progress(tfa_size_t t) { total = t; }
+    void file_end(const virtualtfa_file_info&) { files_ended++; }
+};
+
+struct throwing_listener {
+    void file_start(const virtualtfa_file_info&) { throw std::logic_error("listener failed"); }
+};
+
+std::vector<char> write_all(auto& w) {
+    std::vector<char> out;
+    std::vector<char> buffer(1000);
+    w.write_to([&](std::span<const char> bytes) { out.insert(out.end(), bytes.begin(), bytes.end()); }, buffer);
+    return out;
+}
+
+// Resumes coroutines from a queue drained by the test, like the loop of an async server
+struct queue_executor {
+    std::deque<std::coroutine_handle<>> queue;
+
+    void operator()(std::coroutine_handle<> handle) { queue.push_back(handle); }
+
+    void run() {
+        while (!queue.empty()) {
+            std::coroutine_handle<> handle = queue.front();
+            queue.pop_front();
+            handle.resume();
+        }
+    }
+};
+
+struct task {
+    struct promise_type {
+        task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+task copy_archive(virtualtfa::writer<>& w, virtualtfa::reader<>& r, queue_executor& executor, bool& done) {
+    std::vector<char> buffer(777);
+    while (std::size_t bytes_written = co_await w.async_write(buffer, executor)) {
+        std::size_t offset = 0;
+        while (offset < bytes_written) {
+            offset += co_await r.async_read(std::span<const char>(buffer.data() + offset, bytes_written - offset),
+                                            executor);
+        }
+    }
+    done = true;
+}
+
+} // namespace
+
+int main() {
+    const std::string first(5000, 'a');
+    const std::string second = "second file";
+    virtualtfa::entry e1("first", first.size(), [&] { return memory_source{&first}; });
+    virtualtfa::entry e2("second", second.size(), [&] { return memory_source{&second}; });
+    virtualtfa::archive a;
+    a.add(e1);
+    a.add(e2);
+    const tfa_size_t expected_size = 2 * 48 + 5 + 6 + first.size() + second.size();
+
+    // A moved writer keeps its listener, the moved-from handle is released first
+    {
+        auto w = std::make_unique<virtualtfa::writer<counting_listener>>(a);
+        auto w2 = std::move(*w);
+        w.reset();
+        std::vector<char> out = write_all(w2);
+        CHECK(out.size() == expected_size);
+        CHECK(w2.listener().files_ended == 2);
+        CHECK(w2.listener().total == expected_size);
+    }
+
+    // Same for a moved reader
+    std::vector<char> archive_bytes;
+    {
+        virtualtfa::writer<> w(a);
+        archive_bytes = write_all(w);
+    }
+    {
+        auto r = std::make_unique<virtualtfa::reader<counting_listener>>(".");
+        auto r2 = std::move(*r);
+        r.reset();
+        CHECK(r2.read(archive_bytes) == archive_bytes.size());
+        CHECK(r2.listener().files_ended == 2);
+    }
+
+    // Exceptions from a source and from a listener reach the caller unchanged
+    {
+        virtualtfa::entry bad("bad", 10, [] { return throwing_source{}; });
+        virtualtfa::archive b;
+        b.add(bad);
+        virtualtfa::writer<> w(b);
+        bool caught = false;
+        try {
+            write_all(w);
+        } catch (const std::out_of_range& e) {
+            caught = std::string(e.what()) == "source failed";
+        }
+        CHECK(caught);
+    }
+    {
+        virtualtfa::writer<throwing_listener> w(a);
+        bool caught = false;
+        try {
+            write_all(w);
+        } catch (const std::logic_error& e) {
+            caught = std::string(e.what()) == "listener failed";
+        }
+        CHECK(caught);
+        // nothing left pending for unrelated calls
+        virtualtfa::writer<> other(a);
+        CHECK(write_all(other).size() == expected_size);
+    }
+
+    // Awaitables run each call when the executor resumes the coroutine
+    {
+        std::remove("./first");
+        std::remove("./second");
+        virtualtfa::writer<> w(a);
+        virtualtfa::reader<> r(".");
+        queue_executor executor;
+        bool done = false;
+        copy_archive(w, r, executor, done);
+        CHECK(!done);
+        CHECK(executor.queue.size() == 1);
+        executor.run();
+        CHECK(done);
+        CHECK(r.total_read() == expected_size);
+    }
+    return 0;
+}
@@ -0,0 +1,91 @@
+// Delta archive against a previous manifest: unchanged entries are left out, removed ones deleted
+
+#include "test_util.h"
+
+#define FILES_SIZE 4
+
+int main(void) {
+    static const char* names[FILES_SIZE] = {"kept", "changed", "removed", "empty"};
+    static const tfa_size_t sizes[FILES_SIZE] = {3000, 4000, 5000, 0};
+    test_file files[FILES_SIZE];
+    virtualtfa_entry* entries[FILES_SIZE];
+    virtualtfa_archive* archive = virtualtfa_archive_new();
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        files[i].data = test_make_data(sizes[i], (unsigned) i + 3);
+        files[i].size = sizes[i];
+        files[i].short_read = 0;
+        entries[i] = test_add_file(archive, names[i], &files[i]);
+    }
+    tfa_size_t archive_size;
+    char* data = test_write_archive(archive, 1000, &archive_size);
+    CHECK(virtualtfa_archive_write_manifest(archive, "delta_manifest") == 0);
+
+    test_make_dir("delta_out");
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        remove(test_path("delta_out", names[i]));
+    }
+    virtualtfa_reader* reader = virtualtfa_reader_new();
+    virtualtfa_reader_set_dest(reader, "delta_out");
+    test_read_archive(reader, data, archive_size, 777);
+    virtualtfa_reader_free(reader);
+    free(data);
+
+    // Next version: one file changed, one removed, the rest untouched
+    virtualtfa_archive* next = virtualtfa_archive_new();
+    test_file changed = {test_make_data(4500, 99), 4500, 0};
+    virtualtfa_archive_add(next, entries[0]);
+    virtualtfa_entry* changed_entry = test_add_file(next, names[1], &changed);
+    virtualtfa_archive_add(next, entries[3]);
+
+    virtualtfa_manifest* manifest = virtualtfa_manifest_open("delta_manifest");
+    CHECK(manifest != NULL);
+    virtualtfa_archive* delta = virtualtfa_archive_new_delta(next, manifest);
+    CHECK(delta != NULL);
+    tfa_size_t delta_size;
+    data = test_write_archive(delta, 1000, &delta_size);
+    // only the changed file and the deletion record
+    CHECK(delta_size == 2 * 48 + strlen(names[1]) + changed.size + strlen(names[2]));
+
+    reader = virtualtfa_reader_new();
+    virtualtfa_reader_set_dest(reader, "delta_out");
+    test_read_archive(reader, data, delta_size, 333);
+    virtualtfa_reader_free(reader);
+    free(data);
+    CHECK(test_file_equals(test_path("delta_out", names[0]), files[0].data, files[0].size));
+    CHECK(test_file_equals(test_path("delta_out", names[1]), changed.data, changed.size));
+    CHECK(!test_file_equals(test_path("delta_out", names[2]), files[2].data, files[2].size));
+    CHECK(test_file_equals(test_path("delta_out", names[3]), "", 0));
+    virtualtfa_archive_free(delta);
+    virtualtfa_manifest_free(manifest);
+
+    // An empty file that cannot be created fails the read with the consumed bytes reported
+    virtualtfa_archive* blocked = virtualtfa_archive_new();
+    virtualtfa_archive_add(blocked, entries[3]);
+    virtualtfa_archive_add(blocked, entries[0]);
+    data = test_write_archive(blocked, 1000, &archive_size);
+    test_make_dir("delta_blocked");
+    remove("delta_blocked/empty");
+    test_make_dir("delta_blocked/empty");
+    reader = virtualtfa_reader_new();
+    virtualtfa_reader_set_dest(reader, "delta_blocked");
+    tfa_size_t bytes_read = 0;
+    CHECK(virtualtfa_reader_read(reader, data, archive_size, &bytes_read) != 0);
+    CHECK(bytes_read == 48 + strlen(names[3]));
+    CHECK(virtualtfa_reader_get_total_read(reader) == bytes_read);
+    bytes_read = 1;
+    CHECK(virtualtfa_reader_read(reader, data + 48 + 5, archive_size - 48 - 5, &bytes_read) != 0);
+    CHECK(bytes_read == 0);
+    virtualtfa_reader_free(reader);
+    virtualtfa_archive_free(blocked);
+    free(data);
+
+    virtualtfa_entry_free(changed_entry);
+    free((char*) changed.data);
+    virtualtfa_archive_free(next);
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        free((char*) files[i].data);
+        virtualtfa_entry_free(entries[i]);
+    }
+    virtualtfa_archive_free(archive);
+    return 0;
+}
@@ -0,0 +1,110 @@
+// Frozen archive shared by writers producing disjoint ranges on different threads
+
+#include "test_util.h"
+
+#define FILES_SIZE 5
+#define WRITERS_SIZE 4
+
+typedef struct {
+    virtualtfa_archive* archive;
+    tfa_size_t start;
+    tfa_size_t end;
+    char* out;
+    int result;
+} range_job;
+
+static void write_range(void* userdata) {
+    range_job* job = (range_job*) userdata;
+    virtualtfa_writer* writer = virtualtfa_writer_new();
+    virtualtfa_writer_set_archive(writer, job->archive);
+    virtualtfa_writer_set_range(writer, job->start, job->end);
+    tfa_size_t position = job->start;
+    tfa_size_t bytes_written;
+    do {
+        if (virtualtfa_writer_write(writer, job->out + position, 777, &bytes_written) != 0) {
+            job->result = 1;
+            break;
+        }
+        position += bytes_written;
+    } while (bytes_written > 0);
+    if (position != job->end) {
+        job->result = 1;
+    }
+    virtualtfa_writer_free(writer);
+}
+
+int main(void) {
+    static const char* names[FILES_SIZE] = {"a", "bb", "empty", "dddd", "e"};
+    static const tfa_size_t sizes[FILES_SIZE] = {12345, 1, 0, 100000, 4096};
+    test_file files[FILES_SIZE];
+    virtualtfa_entry* entries[FILES_SIZE];
+    virtualtfa_archive* archive = virtualtfa_archive_new();
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        files[i].data = test_make_data(sizes[i], (unsigned) i + 21);
+        files[i].size = sizes[i];
+        files[i].short_read = 0;
+        entries[i] = test_add_file(archive, names[i], &files[i]);
+    }
+    tfa_size_t expected_size;
+    char* expected = test_write_archive(archive, 1000, &expected_size);
+
+    CHECK(!virtualtfa_archive_is_frozen(archive));
+    CHECK(virtualtfa_archive_freeze(archive) == 0);
+    CHECK(virtualtfa_archive_is_frozen(archive));
+    CHECK(virtualtfa_archive_freeze(archive) == 0);
+
+    // Frozen archives refuse changes
+    virtualtfa_entry* late = virtualtfa_entry_new();
+    virtualtfa_entry_set_name(late, "late");
+    virtualtfa_archive_add(archive, late);
+    CHECK(virtualtfa_archive_sort_by_layout(archive) != 0);
+
+    virtualtfa_writer* writer = virtualtfa_writer_new();
+    virtualtfa_writer_set_archive(writer, archive);
+    CHECK(virtualtfa_writer_calc_size(writer) == expected_size);
+    virtualtfa_writer_free(writer);
+
+    // Same bytes as before freezing, written whole
+    tfa_size_t frozen_size;
+    char* frozen = test_write_archive(archive, 333, &frozen_size);
+    CHECK(frozen_size == expected_size);
+    CHECK(memcmp(frozen, expected, expected_size) == 0);
+    free(frozen);
+
+    // and in ranges cut across headers, names and data, written in parallel
+    char* out = (char*) calloc(expected_size, 1);
+    range_job jobs[WRITERS_SIZE];
+    test_thread threads[WRITERS_SIZE];
+    for (int i = 0; i < WRITERS_SIZE; ++i) {
+        jobs[i].archive = archive;
+        jobs[i].start = expected_size * i / WRITERS_SIZE + (i ? 7 : 0);
+        jobs[i].end = i + 1 < WRITERS_SIZE ? expected_size * (i + 1) / WRITERS_SIZE + 7 : expected_size;
+        jobs[i].out = out;
+        jobs[i].result = 0;
+        test_thread_start(&threads[i], write_range, &jobs[i]);
+    }
+    for (int i = 0; i < WRITERS_SIZE; ++i) {
+        test_thread_join(&threads[i]);
+        CHECK(jobs[i].result == 0);
+    }
+    CHECK(memcmp(out, expected, expected_size) == 0);
+
+    test_make_dir("frozen_out");
+    virtualtfa_reader* reader = virtualtfa_reader_new();
+    virtualtfa_reader_set_dest(reader, "frozen_out");
+    test_read_archive(reader, out, expected_size, 4096);
+    virtualtfa_reader_free(reader);
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        CHECK(test_file_equals(test_path("frozen_out", names[i]), files[i].size ? files[i].data : "", files[i].size));
+    }
+
+    free(out);
+    free(expected);
+    virtualtfa_entry_free(late);
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        free((char*) files[i].data);
+        virtualtfa_entry_free(entries[i]);
+    }
+    virtualtfa_archive_free(archive);
+    return 0;
+}
@@ -0,0 +1,138 @@
+// Scatter-gather output advanced by partial sends, with sources returning short reads
+
+#include "test_util.h"
+
+#define FILES_SIZE 4
+
+static const char* names[FILES_SIZE] = {"first", "empty", "large", "last"};
+static const tfa_size_t sizes[FILES_SIZE] = {7000, 0, 2500000, 10};
+
+typedef struct {
+    tfa_size_t sent; // archive bytes advanced past
+    tfa_size_t ends[FILES_SIZE]; // archive position of each file data end
+    int ended[FILES_SIZE];
+    tfa_size_t progress[FILES_SIZE];
+} sent_state;
+
+static int file_index(const virtualtfa_file_info* info) {
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        if (strcmp(info->name, names[i]) == 0) return i;
+    }
+    CHECK(0);
+    return -1;
+}
+
+static void on_total_progress(void* userdata, tfa_size_t total) {
+    CHECK(total == ((sent_state*) userdata)->sent);
+}
+
+static void on_file_start(void* userdata, const virtualtfa_file_info* info) {
+    (void) userdata;
+    file_index(info);
+}
+
+static void on_file_progress(void* userdata, const virtualtfa_file_info* info, tfa_size_t progress) {
+    sent_state* state = (sent_state*) userdata;
+    int i = file_index(info);
+    CHECK(progress > state->progress[i] && progress <= sizes[i]);
+    // never ahead of what was sent
+    CHECK(state->ends[i] - sizes[i] + progress <= state->sent);
+    state->progress[i] = progress;
+}
+
+static void on_file_end(void* userdata, const virtualtfa_file_info* info) {
+    sent_state* state = (sent_state*) userdata;
+    int i = file_index(info);
+    CHECK(state->ends[i] <= state->sent);
+    CHECK(state->progress[i] == sizes[i]);
+    state->ended[i]++;
+}
+
+int main(void) {
+    test_file files[FILES_SIZE];
+    virtualtfa_entry* entries[FILES_SIZE];
+    virtualtfa_archive* archive = virtualtfa_archive_new();
+    sent_state state;
+    memset(&state, 0, sizeof(state));
+    tfa_size_t position = 0;
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        files[i].data = test_make_data(sizes[i], (unsigned) i + 31);
+        files[i].size = sizes[i];
+        files[i].short_read = 333;
+        entries[i] = test_add_file(archive, names[i], &files[i]);
+        position += 48 + strlen(names[i]) + sizes[i];
+        state.ends[i] = position;
+    }
+    tfa_size_t expected_size;
+    char* expected = test_write_archive(archive, 4096, &expected_size);
+    CHECK(expected_size == position);
+    CHECK(virtualtfa_archive_freeze(archive) == 0);
+
+    virtualtfa_listener listener;
+    listener.total_progress = on_total_progress;
+    listener.total_progress_userdata = &state;
+    listener.file_start = on_file_start;
+    listener.file_start_userdata = &state;
+    listener.file_progress = on_file_progress;
+    listener.file_progress_userdata = &state;
+    listener.file_end = on_file_end;
+    listener.file_end_userdata = &state;
+
+    virtualtfa_writer* writer = virtualtfa_writer_new();
+    virtualtfa_writer_set_archive(writer, archive);
+    virtualtfa_writer_set_listener(writer, &listener);
+    char* out = (char*) malloc(expected_size);
+    struct iovec iov[5];
+    unsigned seed = 7;
+    for (;;) {
+        int count = 0;
+        CHECK(virtualtfa_writer_next_iovecs(writer, iov, 5, 300000, &count) == 0);
+        if (count == 0) break;
+        size_t available = 0;
+        for (int i = 0; i < count; ++i) {
+            available += iov[i].iov_len;
+        }
+        // like a socket accepting only part of the batch
+        seed = seed * 1103515245u + 12345u;
+        size_t send = 1 + (seed >> 8) % available;
+        size_t copied = 0;
+        for (int i = 0; i < count && copied < send; ++i) {
+            size_t n = iov[i].iov_len < send - copied ? iov[i].iov_len : send - copied;
+            memcpy(out + state.sent + copied, iov[i].iov_base, n);
+            copied += n;
+        }
+        state.sent += send;
+        CHECK(virtualtfa_writer_advance(writer, send) == 0);
+        CHECK(virtualtfa_writer_get_position(writer) == state.sent);
+    }
+    CHECK(state.sent == expected_size);
+    CHECK(memcmp(out, expected, expected_size) == 0);
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        CHECK(state.ended[i] == (sizes[i] > 0 ? 1 : 0));
+    }
+    CHECK(virtualtfa_writer_advance(writer, 1) != 0);
+    virtualtfa_writer_free(writer);
+
+    // A source ending before its declared size is an error, not a short iovec
+    test_file truncated = {files[0].data, sizes[0] - 1, 100};
+    virtualtfa_archive* broken = virtualtfa_archive_new();
+    virtualtfa_entry* truncated_entry = test_add_file(broken, "truncated", &truncated);
+    virtualtfa_entry_set_size(truncated_entry, sizes[0]);
+    CHECK(virtualtfa_archive_freeze(broken) == 0);
+    writer = virtualtfa_writer_new();
+    virtualtfa_writer_set_archive(writer, broken);
+    int count = 0;
+    CHECK(virtualtfa_writer_next_iovecs(writer, iov, 5, 300000, &count) != 0);
+    virtualtfa_writer_free(writer);
+    virtualtfa_archive_free(broken);
+    virtualtfa_entry_free(truncated_entry);
+
+    free(out);
+    free(expected);
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        free((char*) files[i].data);
+        virtualtfa_entry_free(entries[i]);
+    }
+    virtualtfa_archive_free(archive);
+    return 0;
+}
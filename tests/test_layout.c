@@ -0,0 +1,147 @@
+// Layout order: files by first physical extent, by inode where that is unknown, stream-only entries last
+
+#include "test_util.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+#define FILES_SIZE 6
+#define STREAMS_SIZE 2
+#define ENTRIES_SIZE (FILES_SIZE + STREAMS_SIZE)
+
+typedef struct {
+    const char* name;
+    uint64_t physical;
+    uint64_t inode;
+    size_t index;
+} layout_key;
+
+// Written and synced so the allocation cannot move between the archive's lookup and ours
+static void make_file(const char* path, tfa_size_t size) {
+    char* data = test_make_data(size, (unsigned) size);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0);
+    CHECK(write(fd, data, size) == (ssize_t) size);
+    CHECK(fsync(fd) == 0);
+    close(fd);
+    free(data);
+}
+
+// UINT64_MAX physical when the file has no extent or FIEMAP is unsupported, as in the library
+static void get_location(const char* path, uint64_t* out_physical, uint64_t* out_inode) {
+    int fd = open(path, O_RDONLY);
+    CHECK(fd >= 0);
+    struct stat st;
+    CHECK(fstat(fd, &st) == 0);
+    *out_inode = (uint64_t) st.st_ino;
+    *out_physical = UINT64_MAX;
+#if defined(__linux__)
+    union {
+        struct fiemap map;
+        char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } fiemap;
+    memset(&fiemap, 0, sizeof(fiemap));
+    fiemap.map.fm_length = FIEMAP_MAX_OFFSET;
+    fiemap.map.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &fiemap.map) == 0 && fiemap.map.fm_mapped_extents > 0 &&
+        !(fiemap.map.fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))) {
+        *out_physical = fiemap.map.fm_extents[0].fe_physical;
+    }
+#endif
+    close(fd);
+}
+
+static int compare_keys(const void* a, const void* b) {
+    const layout_key* x = (const layout_key*) a;
+    const layout_key* y = (const layout_key*) b;
+    if (x->physical != y->physical) return x->physical < y->physical ? -1 : 1;
+    if (x->inode != y->inode) return x->inode < y->inode ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Entry names in archive order, walking the headers
+static void check_order(virtualtfa_archive* archive, const layout_key* expected) {
+    tfa_size_t size;
+    char* data = test_write_archive(archive, 4096, &size);
+    tfa_size_t offset = 0;
+    for (int i = 0; i < ENTRIES_SIZE; ++i) {
+        CHECK(offset + 48 <= size);
+        const unsigned char* header = (const unsigned char*) data + offset;
+        uint32_t namesize = (uint32_t) header[36] << 24 | (uint32_t) header[37] << 16 | (uint32_t) header[38] << 8 | header[39];
+        uint64_t filesize = 0;
+        for (int b = 0; b < 8; ++b) {
+            filesize = filesize << 8 | header[40 + b];
+        }
+        CHECK(namesize == strlen(expected[i].name));
+        CHECK(memcmp(data + offset + 48, expected[i].name, namesize) == 0);
+        offset += 48 + namesize + filesize;
+    }
+    CHECK(offset == size);
+    free(data);
+}
+
+int main(void) {
+    // Empty files have no extent on any filesystem, so they always fall back to their inode
+    static const char* names[FILES_SIZE] = {"a", "empty1", "b", "empty2", "c", "empty3"};
+    static const tfa_size_t sizes[FILES_SIZE] = {100000, 0, 4096, 0, 12345, 0};
+    static const char* stream_names[STREAMS_SIZE] = {"stream1", "stream2"};
+    test_make_dir("layout_in");
+    char paths[FILES_SIZE][64];
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        snprintf(paths[i], sizeof(paths[i]), "layout_in/%s", names[i]);
+        make_file(paths[i], sizes[i]);
+    }
+
+    // Files added in reverse creation order, stream-only entries in between
+    virtualtfa_archive* archive = virtualtfa_archive_new();
+    virtualtfa_entry* entries[ENTRIES_SIZE];
+    layout_key keys[ENTRIES_SIZE];
+    test_file stream = {"stream", 6, 0};
+    size_t entries_size = 0;
+    for (int i = FILES_SIZE - 1; i >= 0; --i) {
+        if (i == 4 || i == 1) {
+            const char* name = stream_names[i == 1];
+            entries[entries_size] = test_add_file(archive, name, &stream);
+            keys[entries_size] = (layout_key) {name, UINT64_MAX, UINT64_MAX, entries_size};
+            ++entries_size;
+        }
+        virtualtfa_entry* entry = virtualtfa_entry_new();
+        CHECK(virtualtfa_entry_set_file(entry, paths[i]) == 0);
+        virtualtfa_entry_set_name(entry, names[i]);
+        virtualtfa_archive_add(archive, entry);
+        entries[entries_size] = entry;
+        keys[entries_size].name = names[i];
+        get_location(paths[i], &keys[entries_size].physical, &keys[entries_size].inode);
+        keys[entries_size].index = entries_size;
+        ++entries_size;
+    }
+    CHECK(entries_size == ENTRIES_SIZE);
+    check_order(archive, keys);
+
+    CHECK(virtualtfa_archive_sort_by_layout(archive) == 0);
+    qsort(keys, ENTRIES_SIZE, sizeof(layout_key), compare_keys);
+    CHECK(strcmp(keys[ENTRIES_SIZE - 2].name, "stream1") == 0);
+    CHECK(strcmp(keys[ENTRIES_SIZE - 1].name, "stream2") == 0);
+    check_order(archive, keys);
+
+    // Sorting again changes nothing
+    CHECK(virtualtfa_archive_sort_by_layout(archive) == 0);
+    check_order(archive, keys);
+
+    // Frozen archives keep their order
+    CHECK(virtualtfa_archive_freeze(archive) == 0);
+    CHECK(virtualtfa_archive_sort_by_layout(archive) != 0);
+    check_order(archive, keys);
+
+    for (int i = 0; i < ENTRIES_SIZE; ++i) {
+        virtualtfa_entry_free(entries[i]);
+    }
+    virtualtfa_archive_free(archive);
+    return 0;
+}
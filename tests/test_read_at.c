@@ -0,0 +1,89 @@
+// Ranges of an archive delivered out of order through virtualtfa_reader_read_at
+
+#include "test_util.h"
+
+#define FILES_SIZE 4
+#define RANGES_SIZE 64
+
+int main(void) {
+    static const tfa_size_t sizes[FILES_SIZE] = {0, 1, 70000, 300000};
+    static const char* names[FILES_SIZE] = {"empty", "one", "medium", "large"};
+    test_file files[FILES_SIZE];
+    virtualtfa_entry* entries[FILES_SIZE];
+    virtualtfa_archive* archive = virtualtfa_archive_new();
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        files[i].data = test_make_data(sizes[i], (unsigned) i + 1);
+        files[i].size = sizes[i];
+        files[i].short_read = 0;
+        entries[i] = test_add_file(archive, names[i], &files[i]);
+    }
+    tfa_size_t archive_size;
+    char* data = test_write_archive(archive, 4096, &archive_size);
+
+    // Cut into uneven ranges and deliver them in a shuffled order, some twice
+    tfa_size_t bounds[RANGES_SIZE + 1];
+    for (int i = 0; i <= RANGES_SIZE; ++i) {
+        bounds[i] = archive_size * (tfa_size_t) i * i / ((tfa_size_t) RANGES_SIZE * RANGES_SIZE);
+    }
+    int order[RANGES_SIZE];
+    for (int i = 0; i < RANGES_SIZE; ++i) {
+        order[i] = i;
+    }
+    unsigned seed = 42;
+    for (int i = RANGES_SIZE - 1; i > 0; --i) {
+        seed = seed * 1103515245u + 12345u;
+        int j = (int) ((seed >> 16) % (unsigned) (i + 1));
+        int tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    test_make_dir("read_at_out");
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        remove(test_path("read_at_out", names[i]));
+    }
+    virtualtfa_reader* reader = virtualtfa_reader_new();
+    virtualtfa_reader_set_dest(reader, "read_at_out");
+    FILE* spool = tmpfile();
+    CHECK(spool != NULL);
+    virtualtfa_reader_set_spool(reader, spool);
+    for (int i = 0; i < RANGES_SIZE; ++i) {
+        tfa_size_t start = bounds[order[i]];
+        tfa_size_t size = bounds[order[i] + 1] - start;
+        tfa_size_t bytes_read = 0;
+        CHECK(virtualtfa_reader_read_at(reader, start, data + start, size, &bytes_read) == 0);
+        CHECK(bytes_read == size);
+        if (i % 8 == 0) { // duplicate delivery
+            CHECK(virtualtfa_reader_read_at(reader, start, data + start, size, &bytes_read) == 0);
+            CHECK(bytes_read == size);
+        }
+    }
+    CHECK(virtualtfa_reader_get_total_read(reader) == archive_size);
+    virtualtfa_reader_free(reader);
+    fclose(spool);
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        CHECK(test_file_equals(test_path("read_at_out", names[i]), files[i].data, files[i].size));
+    }
+
+    // Without a spool a range ahead of the parsed stream is refused and nothing is reported consumed
+    reader = virtualtfa_reader_new();
+    virtualtfa_reader_set_dest(reader, "read_at_out");
+    tfa_size_t bytes_read = 1;
+    CHECK(virtualtfa_reader_read_at(reader, 100, data + 100, 100, &bytes_read) != 0);
+    CHECK(bytes_read == 0);
+    CHECK(virtualtfa_reader_read_at(reader, 0, data, 150, &bytes_read) == 0);
+    CHECK(bytes_read == 150);
+    // Overlapping the parsed stream only the new part is parsed
+    CHECK(virtualtfa_reader_read_at(reader, 100, data + 100, 100, &bytes_read) == 0);
+    CHECK(bytes_read == 100);
+    CHECK(virtualtfa_reader_get_total_read(reader) == 200);
+    virtualtfa_reader_free(reader);
+
+    free(data);
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        free((char*) files[i].data);
+        virtualtfa_entry_free(entries[i]);
+    }
+    virtualtfa_archive_free(archive);
+    return 0;
+}
@@ -0,0 +1,99 @@
+// Archive streamed through a pipe by another thread and consumed with virtualtfa_reader_read_from_fd
+
+#include "test_util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#define FILES_SIZE 4
+
+typedef struct {
+    const char* data;
+    tfa_size_t size;
+    int fd;
+} pipe_job;
+
+static void write_pipe(void* userdata) {
+    pipe_job* job = (pipe_job*) userdata;
+    tfa_size_t written = 0;
+    while (written < job->size) {
+        // uneven writes so headers and data arrive split
+        size_t to_write = (size_t) (job->size - written < 7777 ? job->size - written : 7777);
+        ssize_t n = write(job->fd, job->data + written, to_write);
+        CHECK(n > 0);
+        written += (tfa_size_t) n;
+    }
+    close(job->fd);
+}
+
+int main(void) {
+    static const char* names[FILES_SIZE] = {"small", "empty", "large", "chunked"};
+    static const tfa_size_t sizes[FILES_SIZE] = {100, 0, 3000000, 50000};
+    test_file files[FILES_SIZE];
+    virtualtfa_entry* entries[FILES_SIZE];
+    virtualtfa_archive* archive = virtualtfa_archive_new();
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        files[i].data = test_make_data(sizes[i], (unsigned) i + 41);
+        files[i].size = sizes[i];
+        files[i].short_read = 0;
+        entries[i] = test_add_file(archive, names[i], &files[i]);
+    }
+    virtualtfa_entry_set_typeflag(entries[3], VIRTUALTFA_TYPEFLAG_CHUNKED);
+    virtualtfa_entry_set_size(entries[3], VIRTUALTFA_SIZE_UNKNOWN);
+    tfa_size_t archive_size;
+    char* data = test_write_archive(archive, 65536, &archive_size);
+
+    test_make_dir("read_from_fd_out");
+    for (int blocking = 1; blocking >= 0; --blocking) {
+        for (int i = 0; i < FILES_SIZE; ++i) {
+            remove(test_path("read_from_fd_out", names[i]));
+        }
+        int fds[2];
+        CHECK(pipe(fds) == 0);
+        if (!blocking) {
+            CHECK(fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK) == 0);
+        }
+        pipe_job job = {data, archive_size, fds[1]};
+        test_thread thread;
+        test_thread_start(&thread, write_pipe, &job);
+
+        virtualtfa_reader* reader = virtualtfa_reader_new();
+        virtualtfa_reader_set_dest(reader, "read_from_fd_out");
+        tfa_size_t total = 0;
+        tfa_size_t max_bytes = 1000;
+        for (;;) {
+            tfa_size_t bytes_read = 1;
+            CHECK(virtualtfa_reader_read_from_fd(reader, fds[0], max_bytes, &bytes_read) == 0);
+            CHECK(bytes_read <= max_bytes);
+            total += bytes_read;
+            CHECK(virtualtfa_reader_get_total_read(reader) == total);
+            if (bytes_read < max_bytes) {
+                if (blocking) break; // end of input
+                struct pollfd pfd = {fds[0], POLLIN, 0};
+                CHECK(poll(&pfd, 1, 10000) == 1);
+                // POLLHUP with nothing left to read is the end of input
+                char probe;
+                if ((pfd.revents & POLLHUP) && !(pfd.revents & POLLIN) && read(fds[0], &probe, 1) == 0) break;
+            }
+            max_bytes = max_bytes * 3 % 1000003 + 1;
+        }
+        test_thread_join(&thread);
+        close(fds[0]);
+        CHECK(total == archive_size);
+        virtualtfa_reader_free(reader);
+        for (int i = 0; i < FILES_SIZE; ++i) {
+            CHECK(test_file_equals(test_path("read_from_fd_out", names[i]), files[i].size ? files[i].data : "",
+                                   files[i].size));
+        }
+    }
+
+    free(data);
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        free((char*) files[i].data);
+        virtualtfa_entry_free(entries[i]);
+    }
+    virtualtfa_archive_free(archive);
+    return 0;
+}
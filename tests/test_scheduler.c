@@ -0,0 +1,182 @@
+// Grants in proportion to the writer weights under max_concurrency, never faster than the global rate
+//
+// Only ordering and lower bounds are checked, a slow or loaded machine must not fail the test.
+
+#include "test_util.h"
+
+#include <time.h>
+
+#define WRITERS_SIZE 3
+#define QUANTUM (4 * 1024)
+#define FILE_SIZE (1024 * 1024)
+
+static const uint32_t weights[WRITERS_SIZE] = {1, 2, 4};
+
+typedef struct {
+    virtualtfa_scheduler* scheduler;
+    virtualtfa_writer* writer;
+    tfa_size_t written;
+} writer_job;
+
+// Data reads in grant order. With max_concurrency 1 the scheduler runs one write at a time, so
+// the reads never overlap and need no lock of their own.
+typedef struct {
+    int writer;
+    tfa_size_t size;
+} grant_record;
+
+static grant_record* grants;
+static size_t grants_size;
+static size_t grants_capacity;
+static int record_grants;
+
+// Threads start at different times, so the first grants run unlimited and every writer holds one
+// before max_concurrency drops to 1 and recording starts, all writers are backlogged from then on
+static virtualtfa_scheduler* gated_scheduler;
+static int gate_passed[WRITERS_SIZE];
+static test_latch gate_arrived;
+static test_latch gate_released;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static tfa_size_t numbered_read(void* userdata, char* buffer, tfa_size_t buffer_size) {
+    int writer = (int) (intptr_t) userdata;
+    memset(buffer, 'x', buffer_size);
+    if (gated_scheduler && !gate_passed[writer]) {
+        gate_passed[writer] = 1;
+        if (test_latch_count_down(&gate_arrived) == 0) {
+            virtualtfa_scheduler_set_max_concurrency(gated_scheduler, 1);
+            record_grants = 1;
+            test_latch_count_down(&gate_released);
+        }
+        test_latch_wait(&gate_released);
+    } else if (record_grants) {
+        if (grants_size == grants_capacity) {
+            grants_capacity = grants_capacity ? grants_capacity * 2 : 1024;
+            grants = (grant_record*) realloc(grants, grants_capacity * sizeof(grant_record));
+            CHECK(grants != NULL);
+        }
+        grants[grants_size].writer = writer;
+        grants[grants_size].size = buffer_size;
+        grants_size++;
+    }
+    return buffer_size;
+}
+
+static virtualtfa_input_stream* numbered_supplier(void* userdata) {
+    virtualtfa_input_stream* stream = virtualtfa_input_stream_new();
+    virtualtfa_input_stream_set_read_function(stream, numbered_read);
+    virtualtfa_input_stream_set_read_userdata(stream, userdata);
+    return stream;
+}
+
+static void run_writer(void* userdata) {
+    writer_job* job = (writer_job*) userdata;
+    char* buffer = (char*) malloc(QUANTUM);
+    tfa_size_t bytes_written;
+    do {
+        CHECK(virtualtfa_scheduler_write(job->scheduler, job->writer, buffer, QUANTUM, &bytes_written) == 0);
+        CHECK(bytes_written <= QUANTUM);
+        job->written += bytes_written;
+    } while (bytes_written > 0);
+    free(buffer);
+}
+
+// Every writer streams its own archive of one FILE_SIZE entry to the end
+static void run_writers(tfa_size_t rate, int max_concurrency, bool gated) {
+    virtualtfa_scheduler* scheduler = virtualtfa_scheduler_new();
+    gated_scheduler = gated ? scheduler : NULL;
+    virtualtfa_scheduler_set_rate(scheduler, rate);
+    virtualtfa_scheduler_set_max_concurrency(scheduler, max_concurrency);
+    virtualtfa_scheduler_set_quantum(scheduler, QUANTUM);
+    CHECK(virtualtfa_scheduler_get_rate(scheduler) == rate);
+    CHECK(virtualtfa_scheduler_get_max_concurrency(scheduler) == max_concurrency);
+    CHECK(virtualtfa_scheduler_get_quantum(scheduler) == QUANTUM);
+
+    virtualtfa_entry* entries[WRITERS_SIZE];
+    virtualtfa_archive* archives[WRITERS_SIZE];
+    writer_job jobs[WRITERS_SIZE];
+    test_thread threads[WRITERS_SIZE];
+    for (int i = 0; i < WRITERS_SIZE; ++i) {
+        entries[i] = virtualtfa_entry_new();
+        virtualtfa_entry_set_name(entries[i], "file");
+        virtualtfa_entry_set_size(entries[i], FILE_SIZE);
+        virtualtfa_entry_set_input_stream_supplier(entries[i], numbered_supplier);
+        virtualtfa_entry_set_input_stream_supplier_userdata(entries[i], (void*) (intptr_t) i);
+        archives[i] = virtualtfa_archive_new();
+        virtualtfa_archive_add(archives[i], entries[i]);
+        jobs[i].scheduler = scheduler;
+        jobs[i].writer = virtualtfa_writer_new();
+        jobs[i].written = 0;
+        virtualtfa_writer_set_archive(jobs[i].writer, archives[i]);
+        CHECK(virtualtfa_scheduler_register(scheduler, jobs[i].writer, weights[i], 0) == 0);
+    }
+    CHECK(virtualtfa_scheduler_register(scheduler, jobs[0].writer, 1, 0) != 0);
+    for (int i = 0; i < WRITERS_SIZE; ++i) {
+        test_thread_start(&threads[i], run_writer, &jobs[i]);
+    }
+    for (int i = 0; i < WRITERS_SIZE; ++i) {
+        test_thread_join(&threads[i]);
+        CHECK(jobs[i].written == 48 + 4 + FILE_SIZE);
+    }
+
+    for (int i = 0; i < WRITERS_SIZE; ++i) {
+        virtualtfa_scheduler_unregister(scheduler, jobs[i].writer);
+        virtualtfa_writer_free(jobs[i].writer);
+        virtualtfa_archive_free(archives[i]);
+        virtualtfa_entry_free(entries[i]);
+    }
+    gated_scheduler = NULL;
+    virtualtfa_scheduler_free(scheduler);
+}
+
+static void check_weights(void) {
+    test_latch_init(&gate_arrived, WRITERS_SIZE);
+    test_latch_init(&gate_released, 1);
+    run_writers(0, 0, true);
+    record_grants = 0;
+    test_latch_destroy(&gate_arrived);
+    test_latch_destroy(&gate_released);
+
+    // Until the first writer is done
+    size_t last[WRITERS_SIZE] = {0};
+    for (size_t i = 0; i < grants_size; ++i) {
+        last[grants[i].writer] = i;
+    }
+    size_t end = last[0];
+    for (int i = 1; i < WRITERS_SIZE; ++i) {
+        end = last[i] < end ? last[i] : end;
+    }
+    tfa_size_t window[WRITERS_SIZE] = {0};
+    for (size_t i = 0; i <= end; ++i) {
+        window[grants[i].writer] += grants[i].size;
+    }
+    CHECK(window[0] > 0);
+    CHECK(window[0] < window[1]);
+    CHECK(window[1] < window[2]);
+    free(grants);
+    grants = NULL;
+    grants_size = 0;
+    grants_capacity = 0;
+}
+
+// The bucket starts with one second of rate and a grant overdraws it by one quantum at most
+static void check_rate(tfa_size_t rate, int max_concurrency) {
+    uint64_t start_ms = now_ms();
+    run_writers(rate, max_concurrency, false);
+    uint64_t elapsed_ms = now_ms() - start_ms;
+    double total = (double) WRITERS_SIZE * (48 + 4 + FILE_SIZE);
+    double min_ms = ((total - QUANTUM) / (double) rate - 1.0) * 1000.0;
+    CHECK((double) elapsed_ms >= min_ms - 1.0);
+}
+
+int main(void) {
+    check_weights();
+    check_rate(2 * 1024 * 1024, 0);
+    check_rate(2 * 1024 * 1024, 2);
+    return 0;
+}
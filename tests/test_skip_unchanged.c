@@ -0,0 +1,130 @@
+// Skip-unchanged extraction, the skipped callback and the metadata applied to extracted files
+
+#include "test_util.h"
+
+#include <utime.h>
+
+#define FILES_SIZE 4
+
+static const char* names[FILES_SIZE] = {"same", "tampered", "hashed", "setuid"};
+
+typedef struct {
+    int skipped[FILES_SIZE];
+} skip_state;
+
+static void on_skipped(void* userdata, const virtualtfa_file_info* info) {
+    skip_state* state = (skip_state*) userdata;
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        if (strcmp(info->name, names[i]) == 0) {
+            state->skipped[i]++;
+            return;
+        }
+    }
+    CHECK(0);
+}
+
+static uint64_t hash_data(const char* data, tfa_size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (tfa_size_t i = 0; i < size; ++i) {
+        hash = (hash ^ (unsigned char) data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static int hash_path(void* userdata, const char* path, uint64_t* out_hash) {
+    (void) userdata;
+    FILE* file = fopen(path, "rb");
+    if (!file) return 1;
+    char buffer[4096];
+    uint64_t hash = 14695981039346656037ull;
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        for (size_t i = 0; i < n; ++i) {
+            hash = (hash ^ (unsigned char) buffer[i]) * 1099511628211ull;
+        }
+    }
+    fclose(file);
+    *out_hash = hash;
+    return 0;
+}
+
+// Same size and mtime, different bytes
+static void tamper(const char* path, tfa_utime_t mtime) {
+    FILE* file = fopen(path, "r+b");
+    CHECK(file != NULL);
+    CHECK(fputc('!', file) != EOF);
+    fclose(file);
+    struct utimbuf times = {(time_t) mtime, (time_t) mtime};
+    CHECK(utime(path, &times) == 0);
+}
+
+static void extract(virtualtfa_archive* archive, skip_state* state) {
+    tfa_size_t archive_size;
+    char* data = test_write_archive(archive, 4096, &archive_size);
+    virtualtfa_reader* reader = virtualtfa_reader_new();
+    virtualtfa_reader_set_dest(reader, "skip_out");
+    virtualtfa_reader_set_skip_unchanged(reader, true);
+    virtualtfa_reader_set_hash_function(reader, hash_path);
+    virtualtfa_reader_set_skipped_function(reader, on_skipped);
+    virtualtfa_reader_set_skipped_userdata(reader, state);
+    test_read_archive(reader, data, archive_size, 1000);
+    CHECK(virtualtfa_reader_get_total_read(reader) == archive_size);
+    virtualtfa_reader_free(reader);
+    free(data);
+}
+
+int main(void) {
+    test_file files[FILES_SIZE];
+    virtualtfa_entry* entries[FILES_SIZE];
+    virtualtfa_archive* archive = virtualtfa_archive_new();
+    test_make_dir("skip_out");
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        files[i].data = test_make_data(5000, (unsigned) i + 51);
+        files[i].size = 5000;
+        files[i].short_read = 0;
+        entries[i] = test_add_file(archive, names[i], &files[i]);
+        remove(test_path("skip_out", names[i]));
+    }
+    virtualtfa_entry_set_hash(entries[2], hash_data(files[2].data, files[2].size));
+    virtualtfa_entry_set_mode(entries[3], 04755);
+
+    // Nothing to skip the first time
+    skip_state state;
+    memset(&state, 0, sizeof(state));
+    extract(archive, &state);
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        CHECK(state.skipped[i] == 0);
+        CHECK(test_file_equals(test_path("skip_out", names[i]), files[i].data, files[i].size));
+        struct stat st;
+        CHECK(stat(test_path("skip_out", names[i]), &st) == 0);
+        CHECK((tfa_utime_t) st.st_mtime == 1700000000);
+        CHECK((st.st_mode & 07777) == (i == 3 ? 0755 : 0644));
+    }
+
+    // Size and mtime match, so the tampered file is left alone, while a hash mismatch rewrites it
+    tamper(test_path("skip_out", names[1]), 1700000000);
+    tamper(test_path("skip_out", names[2]), 1700000000);
+    extract(archive, &state);
+    CHECK(state.skipped[0] == 1);
+    CHECK(state.skipped[1] == 1);
+    CHECK(state.skipped[2] == 0);
+    CHECK(state.skipped[3] == 1);
+    CHECK(!test_file_equals(test_path("skip_out", names[1]), files[1].data, files[1].size));
+    CHECK(test_file_equals(test_path("skip_out", names[2]), files[2].data, files[2].size));
+
+    // A different mtime is a change, an entry without mtime leaves the extraction time
+    virtualtfa_entry_set_mtime(entries[0], 0);
+    memset(&state, 0, sizeof(state));
+    extract(archive, &state);
+    CHECK(state.skipped[0] == 0);
+    struct stat st;
+    CHECK(stat(test_path("skip_out", names[0]), &st) == 0);
+    CHECK(st.st_mtime > 1700000000);
+
+    for (int i = 0; i < FILES_SIZE; ++i) {
+        free((char*) files[i].data);
+        virtualtfa_entry_free(entries[i]);
+    }
+    virtualtfa_archive_free(archive);
+    return 0;
+}
@@ -0,0 +1,70 @@
+// Files with holes go through the archive as sparse entries and come back with the same content
+
+#include "test_util.h"
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+#define HOLE_SIZE (1024 * 1024)
+#define DATA_SIZE 8192
+
+int main(void) {
+    // data, hole, data, hole, data, trailing hole
+    char* data = test_make_data(3 * DATA_SIZE, 17);
+    tfa_size_t size = 3 * DATA_SIZE + 3 * HOLE_SIZE;
+    FILE* file = fopen("sparse_src", "wb");
+    CHECK(file != NULL);
+    for (int i = 0; i < 3; ++i) {
+        CHECK(fseek(file, (long) i * (DATA_SIZE + HOLE_SIZE), SEEK_SET) == 0);
+        CHECK(fwrite(data + i * DATA_SIZE, 1, DATA_SIZE, file) == DATA_SIZE);
+    }
+#if defined(_WIN32)
+    CHECK(fseek(file, (long) size - 1, SEEK_SET) == 0);
+    CHECK(fputc(0, file) == 0);
+#else
+    fflush(file);
+    CHECK(ftruncate(fileno(file), (off_t) size) == 0);
+#endif
+    fclose(file);
+    char* expected = (char*) calloc(size, 1);
+    for (int i = 0; i < 3; ++i) {
+        memcpy(expected + i * (DATA_SIZE + HOLE_SIZE), data + i * DATA_SIZE, DATA_SIZE);
+    }
+
+    virtualtfa_entry* entry = virtualtfa_entry_new();
+    CHECK(virtualtfa_entry_set_file(entry, "sparse_src") == 0);
+    virtualtfa_entry_set_name(entry, "sparse");
+    virtualtfa_archive* archive = virtualtfa_archive_new();
+    virtualtfa_archive_add(archive, entry);
+    tfa_size_t archive_size;
+    char* archive_data = test_write_archive(archive, 5000, &archive_size);
+    // holes are only detected where the filesystem reports them
+    if (virtualtfa_entry_get_typeflag(entry) == VIRTUALTFA_TYPEFLAG_SPARSE) {
+        CHECK(archive_size < 4 * DATA_SIZE);
+    } else {
+        fprintf(stderr, "filesystem does not report holes, testing the plain path\n");
+        CHECK(archive_size > size);
+    }
+
+    test_make_dir("sparse_out");
+    remove(test_path("sparse_out", "sparse"));
+    const tfa_size_t read_chunks[] = {1, 100, 1 << 20};
+    for (size_t c = 0; c < sizeof(read_chunks) / sizeof(read_chunks[0]); ++c) {
+        virtualtfa_reader* reader = virtualtfa_reader_new();
+        virtualtfa_reader_set_dest(reader, "sparse_out");
+        // one byte at a time covers every split of the map, skip it for the plain path
+        if (read_chunks[c] > 1 || archive_size < 4 * DATA_SIZE) {
+            test_read_archive(reader, archive_data, archive_size, read_chunks[c]);
+            CHECK(test_file_equals(test_path("sparse_out", "sparse"), expected, size));
+        }
+        virtualtfa_reader_free(reader);
+    }
+
+    free(archive_data);
+    free(expected);
+    free(data);
+    virtualtfa_archive_free(archive);
+    virtualtfa_entry_free(entry);
+    return 0;
+}
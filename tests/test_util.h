@@ -0,0 +1,259 @@
+#pragma once
+
+// Helpers shared by the tests, every test is a standalone executable returning 0 on success
+
+#include "virtualtfa.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#else
+#include <pthread.h>
+#include <sys/stat.h>
+#endif
+
+#define CHECK(condition)                                                                  \
+    do {                                                                                  \
+        if (!(condition)) {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1);                                                                      \
+        }                                                                                 \
+    } while (0)
+
+/* In-memory files */
+
+typedef struct {
+    const char* data;
+    tfa_size_t size;
+    tfa_size_t short_read; // every read returns at most this many bytes, 0 for no limit
+} test_file;
+
+typedef struct {
+    const test_file* file;
+    tfa_size_t pos;
+} test_source;
+
+static inline tfa_size_t test_read(void* userdata, char* buffer, tfa_size_t buffer_size) {
+    test_source* source = (test_source*) userdata;
+    tfa_size_t to_read = source->file->size - source->pos;
+    if (to_read > buffer_size) to_read = buffer_size;
+    if (source->file->short_read && to_read > source->file->short_read) to_read = source->file->short_read;
+    memcpy(buffer, source->file->data + source->pos, to_read);
+    source->pos += to_read;
+    return to_read;
+}
+
+static inline int test_seek(void* userdata, tfa_size_t offset) {
+    test_source* source = (test_source*) userdata;
+    if (offset > source->file->size) return 1;
+    source->pos = offset;
+    return 0;
+}
+
+static inline void test_close(void* userdata) {
+    free(userdata);
+}
+
+static inline virtualtfa_input_stream* test_supplier(void* userdata) {
+    test_source* source = (test_source*) malloc(sizeof(test_source));
+    source->file = (const test_file*) userdata;
+    source->pos = 0;
+    virtualtfa_input_stream* stream = virtualtfa_input_stream_new();
+    virtualtfa_input_stream_set_read_function(stream, test_read);
+    virtualtfa_input_stream_set_read_userdata(stream, source);
+    virtualtfa_input_stream_set_seek_function(stream, test_seek);
+    virtualtfa_input_stream_set_seek_userdata(stream, source);
+    virtualtfa_input_stream_set_close_function(stream, test_close);
+    virtualtfa_input_stream_set_close_userdata(stream, source);
+    return stream;
+}
+
+// Deterministic pseudo-random content
+static inline char* test_make_data(tfa_size_t size, unsigned seed) {
+    char* data = (char*) malloc(size ? size : 1);
+    for (tfa_size_t i = 0; i < size; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        data[i] = (char) (seed >> 16);
+    }
+    return data;
+}
+
+static inline virtualtfa_entry* test_add_file(virtualtfa_archive* archive, const char* name, test_file* file) {
+    virtualtfa_entry* entry = virtualtfa_entry_new();
+    virtualtfa_entry_set_name(entry, name);
+    virtualtfa_entry_set_size(entry, file->size);
+    virtualtfa_entry_set_mtime(entry, 1700000000);
+    virtualtfa_entry_set_mode(entry, 0644);
+    virtualtfa_entry_set_input_stream_supplier(entry, test_supplier);
+    virtualtfa_entry_set_input_stream_supplier_userdata(entry, file);
+    virtualtfa_archive_add(archive, entry);
+    return entry;
+}
+
+/* Archives */
+
+// Whole archive produced by a writer through chunk sized writes
+static inline char* test_write_archive(virtualtfa_archive* archive, tfa_size_t chunk_size, tfa_size_t* out_size) {
+    virtualtfa_writer* writer = virtualtfa_writer_new();
+    virtualtfa_writer_set_archive(writer, archive);
+    tfa_size_t capacity = 1024;
+    tfa_size_t size = 0;
+    char* data = (char*) malloc(capacity);
+    tfa_size_t bytes_written;
+    do {
+        while (capacity - size < chunk_size) {
+            capacity *= 2;
+            data = (char*) realloc(data, capacity);
+        }
+        CHECK(virtualtfa_writer_write(writer, data + size, chunk_size, &bytes_written) == 0);
+        size += bytes_written;
+    } while (bytes_written > 0);
+    virtualtfa_writer_free(writer);
+    *out_size = size;
+    return data;
+}
+
+static inline void test_read_archive(virtualtfa_reader* reader, const char* data, tfa_size_t size, tfa_size_t chunk_size) {
+    for (tfa_size_t offset = 0; offset < size; offset += chunk_size) {
+        tfa_size_t to_read = size - offset < chunk_size ? size - offset : chunk_size;
+        tfa_size_t bytes_read = 0;
+        CHECK(virtualtfa_reader_read(reader, (char*) data + offset, to_read, &bytes_read) == 0);
+        CHECK(bytes_read == to_read);
+    }
+}
+
+/* Destination files */
+
+static inline void test_make_dir(const char* path) {
+    mkdir(path, 0755);
+}
+
+static inline char* test_path(const char* dir, const char* name) {
+    static char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return path;
+}
+
+static inline int test_file_equals(const char* path, const char* data, tfa_size_t size) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return 0;
+    char* buffer = (char*) malloc(size + 1);
+    tfa_size_t read = fread(buffer, 1, size + 1, file);
+    fclose(file);
+    int equal = read == size && memcmp(buffer, data, size) == 0;
+    free(buffer);
+    return equal;
+}
+
+/* Threads */
+
+typedef void (*test_thread_function)(void* userdata);
+
+typedef struct {
+    test_thread_function function;
+    void* userdata;
+#if defined(_WIN32)
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+} test_thread;
+
+#if defined(_WIN32)
+static inline DWORD WINAPI test_thread_main(LPVOID userdata) {
+    test_thread* thread = (test_thread*) userdata;
+    thread->function(thread->userdata);
+    return 0;
+}
+#else
+static inline void* test_thread_main(void* userdata) {
+    test_thread* thread = (test_thread*) userdata;
+    thread->function(thread->userdata);
+    return NULL;
+}
+#endif
+
+static inline void test_thread_start(test_thread* thread, test_thread_function function, void* userdata) {
+    thread->function = function;
+    thread->userdata = userdata;
+#if defined(_WIN32)
+    thread->handle = CreateThread(NULL, 0, test_thread_main, thread, 0, NULL);
+    CHECK(thread->handle != NULL);
+#else
+    CHECK(pthread_create(&thread->handle, NULL, test_thread_main, thread) == 0);
+#endif
+}
+
+static inline void test_thread_join(test_thread* thread) {
+#if defined(_WIN32)
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_join(thread->handle, NULL);
+#endif
+}
+
+// Blocks waiters until counted down to zero
+typedef struct {
+    int count;
+#if defined(_WIN32)
+    SRWLOCK mutex;
+    CONDITION_VARIABLE cond;
+#else
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif
+} test_latch;
+
+static inline void test_latch_init(test_latch* latch, int count) {
+    latch->count = count;
+#if defined(_WIN32)
+    InitializeSRWLock(&latch->mutex);
+    InitializeConditionVariable(&latch->cond);
+#else
+    pthread_mutex_init(&latch->mutex, NULL);
+    pthread_cond_init(&latch->cond, NULL);
+#endif
+}
+
+static inline void test_latch_destroy(test_latch* latch) {
+#if !defined(_WIN32)
+    pthread_cond_destroy(&latch->cond);
+    pthread_mutex_destroy(&latch->mutex);
+#else
+    (void) latch;
+#endif
+}
+
+// Returns the count left
+static inline int test_latch_count_down(test_latch* latch) {
+#if defined(_WIN32)
+    AcquireSRWLockExclusive(&latch->mutex);
+    int count = --latch->count;
+    ReleaseSRWLockExclusive(&latch->mutex);
+    if (count == 0) WakeAllConditionVariable(&latch->cond);
+#else
+    pthread_mutex_lock(&latch->mutex);
+    int count = --latch->count;
+    pthread_mutex_unlock(&latch->mutex);
+    if (count == 0) pthread_cond_broadcast(&latch->cond);
+#endif
+    return count;
+}
+
+static inline void test_latch_wait(test_latch* latch) {
+#if defined(_WIN32)
+    AcquireSRWLockExclusive(&latch->mutex);
+    while (latch->count > 0) SleepConditionVariableSRW(&latch->cond, &latch->mutex, INFINITE, 0);
+    ReleaseSRWLockExclusive(&latch->mutex);
+#else
+    pthread_mutex_lock(&latch->mutex);
+    while (latch->count > 0) pthread_cond_wait(&latch->cond, &latch->mutex);
+    pthread_mutex_unlock(&latch->mutex);
+#endif
+}